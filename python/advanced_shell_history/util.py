@@ -124,6 +124,23 @@ def InitLogging():
   logging.basicConfig(**kwargs)
 
 
+def Hash(text, probe=0):
+  """Returns the 64-bit FNV-1a hash of the UTF-8 bytes of text, signed.
+
+  This is the ash_hash SQL function the commands view uses to key command
+  texts, so it must match the one in src/database.cpp.  A positive probe
+  continues the hash with 0x100 | probe, for texts whose hash is taken.
+  """
+  if text is None:
+    return None
+  h = 0xcbf29ce484222325
+  for b in bytearray(text.encode('utf-8')):
+    h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+  if probe > 0:
+    h = ((h ^ (0x100 | (probe & 0xff))) * 0x100000001b3) & 0xffffffffffffffff
+  return h - (1 << 64) if h >= (1 << 63) else h
+
+
 class Database(object):
   """A wrapper around a database connection."""
 
@@ -139,7 +156,7 @@ class Database(object):
         select sql
         from sqlite_master
         where
-          type = 'table'
+          type in ('table', 'view')
           and name = ?;
       '''
       # Check that the table exists, creating it if not.
@@ -173,6 +190,8 @@ class Database(object):
     if Database.filename is None:
       logging.error('Missing ASH_CFG_HISTORY_DB variable?')
     self.connection = sqlite3.connect(Database.filename)
+    self.connection.create_function('ash_hash', 1, Hash)
+    self.connection.create_function('ash_hash', 2, Hash)
     self.connection.row_factory = sqlite3.Row
     self.cursor = self.connection.cursor()
 
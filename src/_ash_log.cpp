@@ -18,16 +18,17 @@
 
 #include "command.hpp"
 #include "config.hpp"
-#include "database.hpp"
 #include "flags.hpp"
 #include "logger.hpp"
+#include "recorder.hpp"
 #include "session.hpp"
-#include "unix.hpp"
 
-#include <stdlib.h>  /* for exit, getenv */
+#include <signal.h>  /* for signal, SIGHUP, SIG_IGN */
+#include <stdlib.h>  /* for exit, getenv, setenv */
+#include <unistd.h>  /* for chdir, getppid */
 
-#include <iostream>  /* for cerr, cout, endl */
-#include <sstream>   /* for stringstream */
+#include <iostream>  /* for cerr, cin, cout, endl */
+#include <sstream>   /* for istringstream, stringstream */
 
 
 DEFINE_string(alert, 'a', 0, "A message to display to the user.");
@@ -42,6 +43,7 @@ DEFINE_int(exit, 'x', 0, "The exit code to use when exiting.");
 DEFINE_flag(version, 'V', "Prints the version and exits.");
 DEFINE_flag(get_session_id, 'S', "Emits the session ID (or creates one).");
 DEFINE_flag(end_session, 'E', "Ends the current session.");
+DEFINE_flag(serve, 0, "Logs the records written to stdin until it closes.");
 
 
 using namespace ash;
@@ -60,6 +62,80 @@ void usage(ostream & out) {
 }
 
 
+/**
+ * Reads size bytes from stdin into value.
+ */
+bool read_bytes(const size_t size, string * value) {
+  value -> assign(size, '\0');
+  return size == 0 || cin.read(&(*value)[0], size);
+}
+
+
+/**
+ * Logs the records the shell writes to stdin for the rest of the session, so
+ * one process, database connection and context serve every prompt.  Each
+ * record is a header line, followed by the raw bytes of the strings it sizes:
+ *
+ *   S       Begins the session and writes its id to stdout.
+ *   C rval start finish number pipes cwd_size oldpwd_size command_size
+ *           Logs a command run in cwd, which is followed by OLDPWD and the
+ *           command itself.
+ *   E       Ends the session and stops serving.
+ *
+ * A malformed record stops the server, since the records after it can't be
+ * told apart.
+ */
+int serve(Recorder & recorder) {
+  // Outlive a hung up terminal long enough to log what the shell sent.
+  signal(SIGHUP, SIG_IGN);
+
+  string line;
+  while (getline(cin, line)) {
+    istringstream header(line);
+    char type = 0;
+    header >> type;
+
+    if (type == 'S') {
+      const long int session_id = recorder.begin_session();
+      stringstream ss;
+      ss << session_id;
+      setenv("ASH_SESSION_ID", ss.str().c_str(), 1);
+      cout << session_id << endl;
+      continue;
+    }
+
+    if (type == 'E') {
+      recorder.end_session();
+      return 0;
+    }
+
+    int rval, start, finish, number;
+    size_t cwd_size, oldpwd_size, command_size;
+    string pipes, cwd, oldpwd, command;
+    if (type != 'C'
+        || !(header >> rval >> start >> finish >> number >> pipes >> cwd_size
+                    >> oldpwd_size >> command_size)
+        || !read_bytes(cwd_size, &cwd)
+        || !read_bytes(oldpwd_size, &oldpwd)
+        || !read_bytes(command_size, &command)) {
+      LOG(ERROR) << "Malformed record: '" << line << "'";
+      return 1;
+    }
+
+    // Commands take their working directory from the process, so follow the
+    // shell around.  PWD keeps the shell's logical path, as when _ash_log is
+    // run from the prompt, rather than the physical one if it has symlinks.
+    if (chdir(cwd.c_str())) {
+      LOG(ERROR) << "Failed to change to the shell's directory: " << cwd;
+    }
+    setenv("PWD", cwd.c_str(), 1);
+    setenv("OLDPWD", oldpwd.c_str(), 1);
+    recorder.record(command, rval, start, finish, number, pipes);
+  }
+  return 0;
+}
+
+
 int main(int argc, char ** argv) {
   if (getenv("ASH_DISABLED")) return FLAGS_exit;
 
@@ -103,29 +179,16 @@ int main(int argc, char ** argv) {
   Session::register_table();
   Command::register_table();
 
+  Recorder recorder(db_file, getppid(), true);
+
+  // Log everything the shell sends until it hangs up: --serve
+  if (FLAGS_serve) {
+    return serve(recorder);
+  }
+
   // Emit the current session number, inserting one if none exists: -S
   if (FLAGS_get_session_id) {
-    Database db = Database(db_file);
-    stringstream ss;
-    char * id = getenv("ASH_SESSION_ID");
-    if (id) {
-      ss << "select count(*) as session_cnt from sessions where id = " << id
-         << " and duration is null;";
-      ResultSet * rs = db.exec(ss.str());
-      if (!rs || rs -> rows != 1) {
-        cerr << "ERROR: session_id(" << id << ") not found, "
-             << "creating new session." << endl << ss.str() << endl;
-        id = 0;
-      }
-      ss.str("");
-    }
-
-    if (id) {
-      cout << id << endl;
-    } else {
-      Session session;
-      cout << db.insert(&session) << endl;
-    }
+    cout << recorder.begin_session() << endl;
   }
 
   // Insert a command into the DB if there's a command to insert.
@@ -137,22 +200,13 @@ int main(int argc, char ** argv) {
     || FLAGS_command_number;
 
   if (command_flag_used) {
-    Database db = Database(db_file);
-    Command com(FLAGS_command, FLAGS_command_exit, FLAGS_command_start,
+    recorder.record(FLAGS_command, FLAGS_command_exit, FLAGS_command_start,
       FLAGS_command_finish, FLAGS_command_number, FLAGS_command_pipe_status);
-    db.insert(&com);
   }
 
   // End the current session in the DB: -E
   if (FLAGS_end_session) {
-    char * id = getenv("ASH_SESSION_ID");
-    if (id == NULL) {
-      LOG(ERROR) << "Can't end the current session: ASH_SESSION_ID undefined.";
-    } else {
-      Session session;
-      Database db = Database(db_file);
-      db.exec(session.get_close_session_sql());
-    }
+    recorder.end_session();
   }
 
   // Set the exit code to match what the previous command exited: -e 123
@@ -0,0 +1,359 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "archive.hpp"
+
+#include "database.hpp"
+#include "logger.hpp"
+
+#include <string.h>  /* for memchr */
+
+#include <sstream>
+
+// This hack silences a warning when compiling on a 64 bit platform with
+// -ansi and -pedantic flags enabled.
+// The original g++ complaint is that 'long long' is deprecated.
+#ifdef __LP64__
+#define SQLITE_INT64_TYPE long int
+#endif
+#include "sqlite3.h"
+
+#include <zlib.h>
+
+
+using namespace ash;
+using namespace std;
+
+
+namespace {
+
+
+/**
+ * Appends the argument values, as one row, to a block of rows.  Each value
+ * is written as 'n' if it is NULL, or else as 'v' followed by its text and a
+ * NUL byte.
+ */
+void pack_step(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+  string ** rows = (string **) sqlite3_aggregate_context(context,
+                                                         sizeof(string *));
+  if (!rows) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (!*rows) *rows = new string();
+  for (int i = 0; i < argc; ++i) {
+    if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+      (*rows) -> push_back('n');
+      continue;
+    }
+    const char * text = (const char *) sqlite3_value_text(argv[i]);
+    (*rows) -> push_back('v');
+    (*rows) -> append(text, sqlite3_value_bytes(argv[i]));
+    (*rows) -> push_back('\0');
+  }
+}
+
+
+/**
+ * Returns the block of rows compressed: its size in four bytes (most
+ * significant first), followed by the zlib stream.
+ */
+void pack_final(sqlite3_context * context) {
+  string ** rows = (string **) sqlite3_aggregate_context(context, 0);
+  if (!rows || !*rows) {
+    sqlite3_result_null(context);
+    return;
+  }
+  const string & in = **rows;
+  uLongf size = compressBound(in.size());
+  vector<Bytef> out(4 + size);
+  for (int i = 0; i < 4; ++i) out[i] = (in.size() >> (24 - 8 * i)) & 0xff;
+  if (compress2(&out[4], &size, (const Bytef *) in.data(), in.size(), 9)
+      == Z_OK)
+  {
+    sqlite3_result_blob(context, &out[0], 4 + size, SQLITE_TRANSIENT);
+  } else {
+    sqlite3_result_error(context, "failed to compress archived rows", -1);
+  }
+  delete *rows;
+  *rows = 0;
+}
+
+
+/**
+ * Uncompresses a block of rows made by pack_final.  Returns false if the
+ * block is corrupt.
+ */
+bool unpack(const void * block, const int bytes, vector<char> & rows) {
+  const Bytef * in = (const Bytef *) block;
+  if (bytes < 4) return false;
+  uLongf size = 0;
+  for (int i = 0; i < 4; ++i) size = (size << 8) | in[i];
+  rows.resize(size);
+  if (!size) return true;
+  return uncompress((Bytef *) &rows[0], &size, in + 4, bytes - 4) == Z_OK
+    && size == rows.size();
+}
+
+
+}  // namespace
+
+
+/**
+ * Returns the archive of the argument history database: ~/.ash/history.db
+ * is archived to ~/.ash/history-archive.db.
+ */
+const string Archive::file(const string & db_file) {
+  const size_t n = db_file.size();
+  if (n > 3 && db_file.compare(n - 3, 3, ".db") == 0) {
+    return db_file.substr(0, n - 3) + "-archive.db";
+  }
+  return db_file + "-archive.db";
+}
+
+
+/**
+ * Attaches the argument archive file to the argument database as the archive
+ * schema, creating it if necessary.
+ */
+Archive::Archive(Database & db, const string & file) : db(db) {
+  sqlite3_create_function(db.db, "ash_pack", -1, SQLITE_UTF8, 0, 0,
+                          pack_step, pack_final);
+  stringstream ss;
+  ss << "ATTACH DATABASE '";
+  for (string::const_iterator i = file.begin(), e = file.end(); i != e; ++i) {
+    if (*i == '\'') ss << '\'';
+    ss << *i;
+  }
+  ss << "' AS archive;";
+  ResultSet * rs = db.exec(ss.str());
+  if (rs) delete rs;
+
+  // Blocks of rows are kept with the range of ids and start times they hold.
+  rs = db.exec(
+    "CREATE TABLE IF NOT EXISTS archive.blocks (\n"
+    "  id integer primary key autoincrement,\n"
+    "  name varchar(20) not null,\n"
+    "  columns text not null,\n"
+    "  first_id integer not null,\n"
+    "  last_id integer not null,\n"
+    "  first_time integer not null,\n"
+    "  last_time integer not null,\n"
+    "  rows integer not null,\n"
+    "  data blob not null\n"
+    ");");
+  if (rs) delete rs;
+  rs = db.exec("CREATE INDEX IF NOT EXISTS archive.blocks_time "
+               "ON blocks (name, last_time);");
+  if (rs) delete rs;
+}
+
+
+/**
+ * Detaches the archive.
+ */
+Archive::~Archive() {
+  ResultSet * rs = db.exec("DETACH DATABASE archive;");
+  if (rs) delete rs;
+}
+
+
+/**
+ * Returns the comma separated columns of the argument table or view.
+ */
+const string Archive::columns(const string & table) const {
+  ResultSet * rs = db.exec("PRAGMA main.table_info(" + table + ");");
+  string names;
+  for (size_t i = 0; rs && i < rs -> rows; ++i) {
+    if (i) names += ", ";
+    names += rs -> cell(i, 1).str();
+  }
+  if (rs) delete rs;
+  return names;
+}
+
+
+/**
+ * Returns the number of rows the argument query selects.
+ */
+long int Archive::count(const string & query) const {
+  ResultSet * rs = db.exec("SELECT COUNT(*) FROM (" + query + ");");
+  long int rows = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : 0;
+  if (rs) delete rs;
+  return rows;
+}
+
+
+/**
+ * Moves up to chunk rows that started before the argument time from the
+ * history into one block of the archive, in a single transaction.  Commands
+ * are moved first, then the sessions that have ended and have no commands
+ * left.  Returns the number of rows moved, which is 0 when there are none
+ * left to move (or on error).
+ */
+long int Archive::move(const time_t before, const int chunk) {
+  string name = "commands", table = "command_runs";
+  stringstream ids;
+  ids << "SELECT id FROM main.command_runs WHERE +start_time < " << before
+      << " ORDER BY id LIMIT " << chunk;
+  long int rows = count(ids.str());
+  if (!rows) {
+    name = table = "sessions";
+    ids.str("");
+    ids << "SELECT id FROM main.sessions AS s\n"
+        << "  WHERE COALESCE(end_time, start_time) < " << before << "\n"
+        << "    AND NOT EXISTS (\n"
+        << "      SELECT 1 FROM main.command_runs WHERE session_id = s.id)\n"
+        << "  ORDER BY id LIMIT " << chunk;
+    rows = count(ids.str());
+  }
+  if (!rows) return 0;
+
+  const string cols = columns(name);
+  stringstream ss;
+  ss << "INSERT INTO archive.blocks (\n"
+     << "  name, columns, first_id, last_id, first_time, last_time, rows,\n"
+     << "  data)\n"
+     << "SELECT '" << name << "', '" << cols << "', MIN(id), MAX(id),\n"
+     << "  MIN(start_time), MAX(start_time), COUNT(*), ash_pack(" << cols
+     << ")\n"
+     << "FROM (\n"
+     << "  SELECT " << cols << " FROM main." << name << "\n"
+     << "  WHERE id IN (" << ids.str() << ")\n"
+     << "  ORDER BY id);\n"
+     << "DELETE FROM main." << table << " WHERE id IN (" << ids.str() << ");";
+  if (!db.run_script(ss.str())) {
+    LOG(ERROR) << "Failed to archive " << name << " from "
+               << db.filename();
+    return 0;
+  }
+  LOG(DEBUG) << "Archived " << rows << " " << name << " from "
+             << db.filename();
+  return rows;
+}
+
+
+/**
+ * Removes the texts and directories that no command refers to any more, and
+ * returns the pages they and the moved rows used to the file system.
+ * Databases created before auto_vacuum was enabled are vacuumed in full once
+ * to enable it.
+ */
+void Archive::compact() {
+  db.run_script(
+    "DELETE FROM main.command_texts\n"
+    "  WHERE id NOT IN (SELECT text_id FROM main.command_runs);\n"
+    "DELETE FROM main.directories\n"
+    "  WHERE id NOT IN (SELECT dir_id FROM main.command_runs);");
+
+  ResultSet * rs = db.exec("PRAGMA main.auto_vacuum;");
+  const bool incremental =
+    rs && rs -> rows == 1 && rs -> cell(0, 0).integer == 2;
+  if (rs) delete rs;
+  if (!incremental) {
+    LOG(INFO) << "Vacuuming " << db.filename() << " to enable auto_vacuum.";
+  }
+  rs = db.exec(incremental ? "PRAGMA main.incremental_vacuum;" : "VACUUM;");
+  if (rs) delete rs;
+}
+
+
+/**
+ * Restores the blocks of archived rows that started between the argument
+ * times into new tables in the argument schema: a temporary database with
+ * commands and sessions tables shaped like the views and tables of the
+ * history.  An until time of 0 is unbounded.  Returns the number of rows
+ * restored.
+ */
+long int Archive::restore(const string & schema, const time_t since,
+                          const time_t until)
+{
+  ResultSet * rs = db.exec("ATTACH DATABASE '' AS " + schema + ";");
+  if (rs) delete rs;
+  const char * names[] = {"commands", "sessions", 0};
+  for (const char ** name = names; *name; ++name) {
+    rs = db.exec(string("CREATE TABLE ") + schema + "." + *name
+                 + " AS SELECT * FROM main." + *name + " WHERE 0;");
+    if (rs) delete rs;
+  }
+
+  stringstream ss;
+  ss << "SELECT name, columns, data FROM archive.blocks\n"
+     << "WHERE last_time >= " << since;
+  if (until) ss << " AND first_time < " << until;
+  ss << "\nORDER BY id;";
+  sqlite3_stmt * blocks = db.prepare_stmt(ss.str());
+
+  rs = db.exec("BEGIN TRANSACTION;");
+  if (rs) delete rs;
+  long int restored = 0;
+  vector<char> rows;
+  while (sqlite3_step(blocks) == SQLITE_ROW) {
+    const string name = (const char *) sqlite3_column_text(blocks, 0);
+    const string cols = (const char *) sqlite3_column_text(blocks, 1);
+    if (!unpack(sqlite3_column_blob(blocks, 2),
+                sqlite3_column_bytes(blocks, 2), rows))
+    {
+      LOG(ERROR) << "Skipping a corrupt block of archived " << name;
+      continue;
+    }
+
+    int columns = 1;
+    stringstream insert;
+    insert << "INSERT INTO " << schema << "." << name << " (" << cols
+           << ") VALUES (?";
+    for (size_t i = 0; i < cols.size(); ++i) {
+      if (cols[i] != ',') continue;
+      insert << ", ?";
+      ++columns;
+    }
+    insert << ");";
+    sqlite3_stmt * ps = db.prepare_stmt(insert.str());
+
+    const char * pos = rows.empty() ? 0 : &rows[0];
+    const char * end = pos + rows.size();
+    while (pos < end) {
+      bool complete = true;
+      for (int c = 1; complete && c <= columns; ++c) {
+        if (pos < end && *pos == 'n') {
+          sqlite3_bind_null(ps, c);
+          ++pos;
+          continue;
+        }
+        const char * nul = pos < end && *pos == 'v'
+          ? (const char *) memchr(pos, '\0', end - pos) : 0;
+        if (nul) {
+          sqlite3_bind_text(ps, c, pos + 1, nul - pos - 1, SQLITE_STATIC);
+          pos = nul + 1;
+        }
+        complete = nul != 0;
+      }
+      if (!complete) {
+        LOG(ERROR) << "Skipping the rest of a corrupt block of " << name;
+        break;
+      }
+      sqlite3_step(ps);
+      sqlite3_reset(ps);
+      ++restored;
+    }
+    sqlite3_finalize(ps);
+  }
+  sqlite3_finalize(blocks);
+  rs = db.exec("COMMIT TRANSACTION;");
+  if (rs) delete rs;
+  return restored;
+}
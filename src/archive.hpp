@@ -0,0 +1,76 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef __ASH_ARCHIVE__
+#define __ASH_ARCHIVE__
+
+
+#include <time.h>  /* for time_t */
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace ash {
+
+class Database;  // Forward declaration.
+
+
+/**
+ * The cold storage of a history database.  Commands and sessions older than
+ * a cutoff are moved out of the history into <history>-archive.db, where they
+ * are kept in blocks of rows compressed with zlib, so that the history itself
+ * stays small no matter how long it is kept.
+ *
+ * Archived rows can't be searched or indexed.  When they are needed, the
+ * blocks for a range of time are restored into a temporary database and read
+ * through the commands and sessions tables alongside the history.
+ */
+class Archive {
+  // STATIC:
+  public:
+    static const string file(const string & db_file);
+
+  // NON-STATIC:
+  public:
+    Archive(Database & db, const string & file);
+    ~Archive();
+
+    long int move(const time_t before, const int chunk);
+    void compact();
+    long int restore(const string & schema, const time_t since,
+                     const time_t until);
+
+  private:
+    const string columns(const string & table) const;
+    long int count(const string & query) const;
+
+  private:
+    Database & db;
+
+  // DISALLOWED:
+  private:
+    Archive(const Archive & other);
+    Archive & operator = (const Archive & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_ARCHIVE__ */
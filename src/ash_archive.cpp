@@ -0,0 +1,115 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+/**
+ * This program moves old history out of the history database into its
+ * compressed archive, keeping the history small enough to stay in the page
+ * cache.  It is meant to run now and then, from cron for example.
+ */
+
+#include "ash_archive.hpp"
+
+#include "archive.hpp"
+#include "command.hpp"
+#include "config.hpp"
+#include "database.hpp"
+#include "flags.hpp"
+#include "logger.hpp"
+#include "session.hpp"
+#include "shards.hpp"
+
+#include <sys/stat.h>  /* for stat */
+#include <time.h>      /* for time */
+
+#include <iostream>  /* for cerr, cout, endl */
+#include <vector>
+
+
+DEFINE_string(database, 'd', 0, "The history database to archive.");
+DEFINE_int(age, 'a', 0, "Archive the history older than this many days.");
+
+DEFINE_flag(version, 'V', "Prints the version and exits.");
+
+
+using namespace ash;
+using namespace flag;
+using namespace std;
+
+
+int main(int argc, char ** argv) {
+  Config & config = Config::instance();
+  Flag::parse(&argc, &argv, true);
+
+  if (FLAGS_version) {
+    cout << ASH_VERSION << endl;
+    return 0;
+  }
+
+  string db_file = FLAGS_database.empty()
+    ? config.get_string("HISTORY_DB")
+    : FLAGS_database;
+  if (db_file.empty()) {
+    cerr << "Expected either --database or ASH_CFG_HISTORY_DB to be defined."
+         << endl;
+    return 1;
+  }
+
+  const long int days = FLAGS_age > 0
+    ? FLAGS_age
+    : config.get_int("ARCHIVE_DAYS", 365);
+  if (days <= 0) {
+    cerr << "Expected --age or ASH_CFG_ARCHIVE_DAYS to be positive." << endl;
+    return 1;
+  }
+  const time_t before = time(0) - days * 24 * 60 * 60;
+
+  // Register the tables expected in the program.
+  Session::register_table();
+  Command::register_table();
+  Database::run_unchunked_migrations(true);
+
+  // Only the months that began before the cutoff can hold rows to archive.
+  vector<string> files;
+  if (Shards::split()) {
+    files = Shards::find(db_file, 0, Shards::month(before));
+  } else {
+    struct stat st;
+    if (!stat(db_file.c_str(), &st)) files.push_back(db_file);
+  }
+
+  // Rows are moved in blocks of this many.  Larger blocks compress better,
+  // but keep loggers waiting longer.
+  const int chunk = 10000;
+  const string archive_file = Archive::file(db_file);
+  typedef vector<string>::const_iterator iter;
+  for (iter i = files.begin(), e = files.end(); i != e; ++i) {
+    Database db(*i);
+    // Each block deletes rows from every index of the history, so a larger
+    // page cache saves reading the same index pages over and over.
+    ResultSet * rs = db.exec("PRAGMA cache_size = -65536;");
+    if (rs) delete rs;
+    Archive archive(db, archive_file);
+    long int moved = 0;
+    for (long int rows; (rows = archive.move(before, chunk)) > 0; ) {
+      moved += rows;
+    }
+    archive.compact();
+    cout << "Archived " << moved << " rows from " << *i << " to "
+         << archive_file << endl;
+  }
+  return 0;
+}
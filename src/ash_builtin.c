@@ -0,0 +1,195 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * A bash loadable builtin that logs commands from inside the shell process,
+ * so a prompt costs a function call rather than a fork and exec of _ash_log:
+ *
+ *   enable -f /usr/local/lib/advanced_shell_history/ash_log.so ash_log
+ *
+ * It takes the same short options as _ash_log, plus -H, which logs the latest
+ * shell history entry without needing a subshell to read it.
+ *
+ * This is C because the bash headers are; the logging itself is done by the
+ * C++ core behind builtin.hpp.
+ */
+
+#include <config.h>
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include <stdio.h>  /* for fprintf, printf */
+#include <time.h>   /* for time */
+
+#include "builtins.h"
+#include "shell.h"
+#include "bashgetopt.h"
+#include "common.h"
+
+#include "builtin.hpp"
+
+
+/**
+ * Readline's history, which is linked into bash.  These are declared here
+ * rather than included, since the bash headers don't ship readline's.
+ */
+typedef struct _hist_entry {
+  char * line;
+  char * timestamp;
+  void * data;
+} HIST_ENTRY;
+
+extern int history_base, history_length;
+extern HIST_ENTRY * history_get (int);
+extern time_t history_get_time (HIST_ENTRY *);
+
+
+/**
+ * Parses a numeric option, complaining if it is not a number.
+ */
+static int
+get_number (const char * option, long int * value)
+{
+  intmax_t number;
+  if (!legal_number (list_optarg, &number)) {
+    builtin_error ("%s: %s: numeric argument required", option, list_optarg);
+    return 0;
+  }
+  *value = (long int) number;
+  return 1;
+}
+
+
+int
+ash_log_builtin (WORD_LIST * list)
+{
+  int opt, begin_session = 0, end_session = 0, from_history = 0, log = 0;
+  long int rval = 0, start = 0, finish = 0, number = 0, exit_code = 0;
+  char * command = 0, * pipes = 0;
+  HIST_ENTRY * entry;
+
+  reset_internal_getopt ();
+  while ((opt = internal_getopt (list, "a:c:e:f:n:p:s:x:EHS")) != -1) {
+    switch (opt) {
+      case 'a':
+        fprintf (stderr, "%s\n", list_optarg);
+        break;
+      case 'c':
+        command = list_optarg;
+        log = 1;
+        break;
+      case 'e':
+        if (!get_number ("-e", &rval)) return (EX_USAGE);
+        log = 1;
+        break;
+      case 'f':
+        if (!get_number ("-f", &finish)) return (EX_USAGE);
+        log = 1;
+        break;
+      case 'n':
+        if (!get_number ("-n", &number)) return (EX_USAGE);
+        log = 1;
+        break;
+      case 'p':
+        pipes = list_optarg;
+        log = 1;
+        break;
+      case 's':
+        if (!get_number ("-s", &start)) return (EX_USAGE);
+        log = 1;
+        break;
+      case 'x':
+        if (!get_number ("-x", &exit_code)) return (EX_USAGE);
+        break;
+      case 'E':
+        end_session = 1;
+        break;
+      case 'H':
+        from_history = log = 1;
+        break;
+      case 'S':
+        begin_session = 1;
+        break;
+      CASE_HELPOPT;
+      default:
+        builtin_usage ();
+        return (EX_USAGE);
+    }
+  }
+
+  if (get_string_value ("ASH_DISABLED")) return ((int) exit_code);
+
+  if (begin_session) {
+    long int session_id = 0;
+    if (ash_begin_session (&session_id) == 0) {
+      printf ("%ld\n", session_id);
+      fflush (stdout);
+    }
+  }
+
+  if (from_history) {
+    number = history_base + history_length - 1;
+    entry = history_get ((int) number);
+    if (entry) {
+      command = entry -> line;
+      start = (long int) history_get_time (entry);
+    }
+    finish = (long int) time (0);
+  }
+  if (log) {
+    ash_record (command ? command : "UNKNOWN", (int) rval, start, finish,
+                (int) number, pipes ? pipes : "0");
+  }
+
+  if (end_session) ash_end_session ();
+
+  return ((int) exit_code);
+}
+
+
+/**
+ * Called by bash when the builtin is removed with enable -d.
+ */
+void
+ash_log_builtin_unload (char * name)
+{
+  ash_unload ();
+}
+
+
+char * ash_log_doc[] = {
+  "Log commands to the advanced shell history database.",
+  "",
+  "Takes the same short options as _ash_log(1).  With -H, the most recent",
+  "history entry is logged along with its number and start time.",
+  "",
+  "Exit Status:",
+  "Returns the exit code given by -x, or zero.",
+  (char *) NULL
+};
+
+
+struct builtin ash_log_struct = {
+  "ash_log",
+  ash_log_builtin,
+  BUILTIN_ENABLED,
+  ash_log_doc,
+  "ash_log [-EHS] [-a alert] [-c command] [-e rval] [-s start] [-f finish] "
+    "[-n number] [-p pipes] [-x exit]",
+  0
+};
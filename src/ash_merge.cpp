@@ -0,0 +1,94 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * This program merges history databases, collected from many hosts say, into
+ * one history database.
+ */
+
+#include "ash_merge.hpp"
+
+#include "command.hpp"
+#include "config.hpp"
+#include "database.hpp"
+#include "flags.hpp"
+#include "logger.hpp"
+#include "merge.hpp"
+#include "session.hpp"
+
+#include <sys/stat.h>  /* for stat */
+
+#include <iostream>  /* for cerr, cout, endl */
+#include <vector>
+
+
+DEFINE_string(database, 'd', 0, "The history database to merge into.");
+
+DEFINE_flag(version, 'V', "Prints the version and exits.");
+
+
+using namespace ash;
+using namespace flag;
+using namespace std;
+
+
+int main(int argc, char ** argv) {
+  Config & config = Config::instance();
+  Flag::parse(&argc, &argv, true);
+
+  if (FLAGS_version) {
+    cout << ASH_VERSION << endl;
+    return 0;
+  }
+
+  string db_file = FLAGS_database.empty()
+    ? config.get_string("HISTORY_DB")
+    : FLAGS_database;
+  if (db_file.empty()) {
+    cerr << "Expected either --database or ASH_CFG_HISTORY_DB to be defined."
+         << endl;
+    return 1;
+  }
+
+  // The remaining arguments are the databases to merge.
+  const vector<string> sources(argv, argv + argc);
+  if (sources.empty()) {
+    cerr << "Expected the history databases to merge." << endl;
+    Flag::show_help(cerr);
+    return 1;
+  }
+
+  // Register the tables expected in the program.
+  Session::register_table();
+  Command::register_table();
+  Database::run_unchunked_migrations(true);
+
+  struct stat st;
+  const bool empty = stat(db_file.c_str(), &st) || st.st_size == 0;
+  Database db(db_file);
+  ResultSet * rs = db.exec("PRAGMA cache_size = -262144;");
+  if (rs) delete rs;
+  long int sessions = 0, commands = 0;
+  {
+    Merge merge(db, empty);
+    commands = merge.merge(sources, sessions);
+  }
+  db.checkpoint();
+  cout << "Merged " << sessions << " sessions and " << commands
+       << " commands from " << sources.size() << " databases into " << db_file
+       << endl;
+  return 0;
+}
@@ -21,6 +21,7 @@
 
 #include "ash_query.hpp"
 
+#include "archive.hpp"
 #include "command.hpp"
 #include "config.hpp"
 #include "database.hpp"
@@ -29,25 +30,39 @@
 #include "logger.hpp"
 #include "queries.hpp"
 #include "session.hpp"
+#include "shards.hpp"
+#include "snapshot.hpp"
+
+#include <sys/stat.h>  /* for stat */
+#include <time.h>      /* for time */
 
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 
 using namespace ash;
 using namespace flag;
 using namespace std;
 
 
+DEFINE_string(cwd, 0, 0, "Only grep commands run in this directory tree.");
 DEFINE_string(database, 'd', 0, "A history database to query.");
 DEFINE_string(format, 'f', 0, "A format to display results.");
+DEFINE_string(grep, 'g', 0, "Scan the snapshot for commands with this text.");
 DEFINE_int(limit, 'l', 0, "Limit the number of rows returned.");
 DEFINE_string(print_query, 'p', 0, "Print the query SQL.");
 DEFINE_string(query, 'q', 0, "The name of the saved query to execute.");
+DEFINE_string(search, 's', 0, "Search the commands for these terms.");
+DEFINE_string(since, 0, 0, "Only read shards from this month (YYYY-MM) on.");
+DEFINE_string(until, 0, 0, "Only read shards up to this month (YYYY-MM).");
 
+DEFINE_flag(archive, 'A', "Include the archived history in the query.");
+DEFINE_flag(explain, 'e', "Show how sqlite will run the query, not its results.");
 DEFINE_flag(list_formats, 'F', "Display all available formats.");
 DEFINE_flag(hide_headings, 'H', "Hide column headings from query results.");
 DEFINE_flag(list_queries, 'Q', "Display all saved queries.");
+DEFINE_flag(snapshot, 'S', "Write a snapshot of the history for --grep.");
 DEFINE_flag(version, 0, "Show the version and exit.");
 
 
@@ -81,44 +96,290 @@ void display(ostream & out, const RowsType & rows, const string & name) {
 
 
 /**
- * Executes a query, printing the results to stdout according to the
- * user-chosen output format.
+ * Returns the SQL that searches the full-text index of command texts for the
+ * argument terms, returning up to limit rows if limit is positive.  The terms
+ * use the FTS4 query syntax: words match anywhere in a command, 'git*' matches
+ * a prefix, '"git commit"' matches a phrase, and terms may be combined with
+ * AND, OR, NOT and parentheses.
+ *
+ * Each distinct command that matches is shown once, with its last run.  They
+ * are ranked by BM25 relevance divided by one plus the number of months (30
+ * days) since the last run.  The cost grows with the number of distinct
+ * commands that match rather than with the size of the history, and only the
+ * rows shown have their texts and directories looked up.
+ *
+ * Each of the argument schemas (shards) has an index of its own, so each is
+ * searched in turn and a command found in several keeps its latest run.
  */
-int execute(const string & sql) {
-  Config & config = Config::instance();
+const string search_sql(const string & terms, const int limit,
+                        const vector<string> & schemas)
+{
+  stringstream match;
+  for (string::const_iterator i = terms.begin(), e = terms.end(); i != e; ++i) {
+    if (*i == '\'') match << '\'';
+    match << *i;
+  }
 
-  // Get the filename backing the database we are about to query.
-  string db_file(FLAGS_database);
-  if (db_file == "") {
-    if (config.get_string("HISTORY_DB") == "") {
-      cerr << "Expected either --database or ASH_CFG_HISTORY_DB "
-           << "to be defined." << endl;
-      return 1;
+  // Grouping a single search would move matchinfo out of its context.
+  const bool grouped = schemas.size() > 1;
+  stringstream ss;
+  ss << "SELECT\n"
+     << "  datetime(r.start_time, 'unixepoch', 'localtime') AS \"last run\",\n"
+     << "  CASE r.shard\n";
+  for (size_t s = 0; s < schemas.size(); ++s) {
+    ss << "    WHEN " << s << " THEN (SELECT path FROM " << schemas[s]
+       << ".directories WHERE id = r.dir_id)\n";
+  }
+  ss << "  END AS \"where\",\n"
+     << "  CASE r.shard\n";
+  for (size_t s = 0; s < schemas.size(); ++s) {
+    ss << "    WHEN " << s << " THEN (SELECT text FROM " << schemas[s]
+       << ".command_texts WHERE id = r.text_id)\n";
+  }
+  ss << "  END AS \"command\"\n"
+     << "FROM\n"
+     << "  (\n"
+     << "    SELECT\n"
+     << "      text_id,\n"
+     << "      shard,\n"
+     << "      dir_id,\n"
+     << (grouped ? "      MAX(start_time) AS start_time,\n"
+                 : "      start_time,\n")
+     << "      rank\n"
+     << "    FROM\n"
+     << "      (\n";
+  for (size_t s = 0; s < schemas.size(); ++s) {
+    if (s) ss << "        UNION ALL\n";
+    ss << "        SELECT\n"
+       << "          m.docid AS text_id,\n"
+       << "          " << s << " AS shard,\n"
+       << "          c.dir_id AS dir_id,\n"
+       << "          c.start_time AS start_time,\n"
+       << "          m.score\n"
+       << "            / (1 + (" << time(0) << " - c.start_time) / 2592000.0)\n"
+       << "            AS rank\n"
+       << "        FROM\n"
+       << "          (\n"
+       << "            SELECT\n"
+       << "              docid,\n"
+       << "              ash_bm25(matchinfo(f.command_search, 'pcnalx'))\n"
+       << "                AS score,\n"
+       << "              (SELECT MAX(id) FROM " << schemas[s]
+       << ".command_runs WHERE text_id = docid)\n"
+       << "                AS last_id\n"
+       << "            FROM " << schemas[s] << ".command_search AS f\n"
+       << "            WHERE f.command_search MATCH '" << match.str() << "'\n"
+       << "          ) AS m\n"
+       << "          INNER JOIN " << schemas[s]
+       << ".command_runs AS c ON c.id = m.last_id\n";
+  }
+  ss << "      )\n";
+  if (grouped) ss << "    GROUP BY text_id\n";
+  ss << "    ORDER BY rank DESC\n"
+     << "    LIMIT " << (limit > 0 ? limit : -1) << "\n"
+     << "  ) AS r\n"
+     << "ORDER BY r.rank DESC;";
+  return ss.str();
+}
+
+
+/**
+ * Attaches the shards of the argument history database that overlap the
+ * --since and --until months, those of every host, to the argument database
+ * (this host's shard for this month), adding the schemas that hold the
+ * history to the argument schemas: the attached shards and main if it is in
+ * range, or just main if the history isn't sharded.
+ * Returns false (with an error printed) if there are more shards than sqlite
+ * can attach at once, since a query of only some of them would be wrong.
+ */
+bool attach_shards(Database & db, const string & db_file, const long int since,
+                   const long int until, vector<string> & schemas)
+{
+  if (!Shards::split()) {
+    schemas.push_back("main");
+    return true;
+  }
+
+  const vector<string> files = Shards::find(db_file, since, until);
+  // Each shard but the main database needs one of sqlite's 62 attachments,
+  // and restoring the archive needs two.
+  const size_t max_files = FLAGS_archive ? 60 : 62;
+  const size_t attached = files.size()
+    - count(files.begin(), files.end(), db.filename());
+  if (attached > max_files) {
+    cerr << "ash_query: " << files.size() << " history files match, but only "
+         << max_files << " can be read at once beside " << db.filename()
+         << ".\nUse --since and --until to read fewer months, or merge the "
+         << "files of some hosts with ash_merge." << endl;
+    return false;
+  }
+
+  typedef vector<string>::const_iterator iter;
+  for (iter i = files.begin(), e = files.end(); i != e; ++i) {
+    if (*i == db.filename()) {
+      schemas.push_back("main");
+      continue;
     }
-    db_file = config.get_string("HISTORY_DB");
+    stringstream schema;
+    schema << "shard" << (i - files.begin());
+    if (db.attach(*i, schema.str())) schemas.push_back(schema.str());
   }
+  return true;
+}
 
-  // Prepare the DB for reading.
-  Session::register_table();
-  Command::register_table();
-  Database db(db_file);
 
-  // Get the intended Formatter before executing the query.
+/**
+ * Restores the archived history that overlaps the --since and --until months
+ * into a temporary schema, returning its name, or an empty string if there
+ * is no archive.
+ */
+const string restore_archive(Database & db, const string & db_file,
+                             const long int since, const long int until)
+{
+  const string file = Archive::file(db_file);
+  struct stat st;
+  if (stat(file.c_str(), &st)) {
+    LOG(WARNING) << "No archive found at " << file;
+    return "";
+  }
+  Archive archive(db, file);
+  const long int rows = archive.restore("archived",
+    since ? Shards::begins(since) : 0,
+    until ? Shards::begins(until + 1) : 0);
+  LOG(DEBUG) << "Restored " << rows << " archived rows from " << file;
+  return "archived";
+}
+
+
+/**
+ * Returns the filename of the history database: --database, or else
+ * ASH_CFG_HISTORY_DB.  An empty string is returned (with an error printed)
+ * if neither is set.
+ */
+const string history_db() {
+  Config & config = Config::instance();
+  if (FLAGS_database != "") return FLAGS_database;
+  if (config.get_string("HISTORY_DB") == "") {
+    cerr << "Expected either --database or ASH_CFG_HISTORY_DB "
+         << "to be defined." << endl;
+  }
+  return config.get_string("HISTORY_DB");
+}
+
+
+/**
+ * Returns the user-chosen Formatter, or null (with an error printed) if
+ * there is no such format.
+ */
+Formatter * get_formatter() {
   string format = FLAGS_format == ""
-    ? config.get_string("DEFAULT_FORMAT", "aligned")
+    ? Config::instance().get_string("DEFAULT_FORMAT", "aligned")
     : FLAGS_format;
   Formatter * formatter = Formatter::lookup(format);
   if (!formatter) {
     cerr << "\nUnknown format: '" << format << "'" << endl;
     display(cerr << '\n', Formatter::get_desc(), "Format");
+  }
+  return formatter;
+}
+
+
+/**
+ * Scans the snapshot of the history for the --grep text, printing the
+ * matching commands to stdout according to the user-chosen output format.
+ */
+int grep(const long int since, const long int until) {
+  const string db_file = history_db();
+  Formatter * formatter = get_formatter();
+  if (db_file == "" || !formatter) return 1;
+
+  const string file = Snapshot::file(db_file);
+  Snapshot snapshot(file);
+  if (!snapshot.is_open()) {
+    cerr << "Can't read a snapshot at " << file << ": write one with --snapshot"
+         << endl;
+    return 1;
+  }
+  ResultSet * rs = snapshot.grep(FLAGS_grep, FLAGS_cwd,
+    since ? Shards::begins(since) : 0,
+    until ? Shards::begins(until + 1) : 0, FLAGS_limit);
+  formatter -> show_headings(!FLAGS_hide_headings);
+  formatter -> insert(rs, cout);
+  delete rs;
+  return 0;
+}
+
+
+/**
+ * Executes a query, or the --search, printing the results to stdout
+ * according to the user-chosen output format.  If explain is set, the query
+ * plan is shown instead.  With --snapshot, the history is copied to a
+ * snapshot for --grep instead.
+ */
+int execute(const string & sql, const bool explain=false) {
+  // Get the filename backing the database we are about to query.
+  const string db_file = history_db();
+  if (db_file == "") return 1;
+
+  // Check the range of shards to read: --since and --until
+  const long int since = Shards::parse_month(FLAGS_since);
+  const long int until = Shards::parse_month(FLAGS_until);
+  if (since < 0 || until < 0) {
+    cerr << "Expected --since and --until as YYYY-MM." << endl;
     return 1;
   }
 
+  // Scan the snapshot rather than the database: --grep and --cwd
+  if (FLAGS_grep != "" || FLAGS_cwd != "") return grep(since, until);
+
+  // Get the intended Formatter before executing the query.
+  Formatter * formatter = get_formatter();
+  if (!formatter) return 1;
+
+  // Prepare the DB for reading.
+  Session::register_table();
+  Command::register_table();
+  Database::run_unchunked_migrations(true);
+  Database db(Shards::current(db_file));
+  vector<string> shards;
+  if (!attach_shards(db, db_file, since, until, shards)) return 1;
+  vector<string> schemas = shards;
+  // Archived rows aren't indexed for search, so they're only read by queries.
+  if (FLAGS_archive && FLAGS_search == "") {
+    const string archived = restore_archive(db, db_file, since, until);
+    if (!archived.empty()) schemas.push_back(archived);
+  }
+  if (Shards::split() || schemas.size() > 1) db.unite(schemas);
+
+  // Copy everything in range to the snapshot: --snapshot
+  if (FLAGS_snapshot) {
+    const string file = Snapshot::file(db_file);
+    const long int rows = Snapshot::write(db, file);
+    if (rows < 0) {
+      cerr << "Failed to write the snapshot " << file << endl;
+      return 1;
+    }
+    cout << "Wrote " << rows << " commands to " << file << endl;
+    return 0;
+  }
+
   // Execute the query and display any results.
-  ResultSet * rs = db.exec(sql, FLAGS_limit);
+  string query = FLAGS_search == ""
+    ? sql
+    : search_sql(FLAGS_search, FLAGS_limit, shards);
+  if (explain) query = "EXPLAIN QUERY PLAN " + query;
+  Cursor * rows = db.cursor(query, FLAGS_limit);
+  Config & config = Config::instance();
   formatter -> show_headings(!FLAGS_hide_headings);
-  formatter -> insert(rs, cout);
-  if (rs) delete rs;
+  // The auto format only streams if asked to, since a window can change which
+  // columns it groups.
+  const bool grouped = formatter == Formatter::lookup("auto");
+  formatter -> window(max(0, grouped
+    ? config.get_int("FORMAT_AUTO_WINDOW", 0)
+    : config.get_int("FORMAT_WINDOW", 1000)));
+  formatter -> clip(config.sets("FORMAT_CLIP"));
+  formatter -> stream(*rows, cout);
+  delete rows;
   return 0;
 }
 
@@ -165,6 +426,8 @@ int main(int argc, char ** argv) {
 
   // Initialize the available formatters.
   CsvFormatter::init();
+  JsonFormatter::init();
+  NdjsonFormatter::init();
   NullFormatter::init();
   SpacedFormatter::init();
   GroupedFormatter::init();
@@ -192,14 +455,17 @@ int main(int argc, char ** argv) {
     return 0;
   }
 
-  // Make sure the requested query exists.
-  string sql = Queries::get_sql(FLAGS_query);
-  if (sql == "") {
+  // Make sure the requested query exists, unless searching, grepping or
+  // writing a snapshot: --search, --grep, --cwd and --snapshot
+  const bool other = FLAGS_search != "" || FLAGS_grep != "" || FLAGS_cwd != ""
+    || FLAGS_snapshot;
+  string sql = other ? "" : Queries::get_sql(FLAGS_query);
+  if (sql == "" && !other) {
     cout << "Query not found: " << FLAGS_query << "\nAvailable:\n";
     display(cout, Queries::get_desc(), "Query");
     return 1;
   }
 
-  // Execute the requested query.
-  return execute(sql);
+  // Execute the requested query, or show its plan instead: --explain
+  return execute(sql, FLAGS_explain);
 }
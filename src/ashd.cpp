@@ -0,0 +1,108 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * This program holds the history database open and writes rows sent by
+ * _ash_log in batches.  It is started by the shell code when a session begins
+ * and exits quietly if another instance is already serving the socket.
+ */
+
+#include "ashd.hpp"
+
+#include "command.hpp"
+#include "config.hpp"
+#include "daemon.hpp"
+#include "flags.hpp"
+#include "logger.hpp"
+#include "session.hpp"
+
+#include <fcntl.h>   /* for open */
+#include <stdlib.h>  /* for exit */
+#include <unistd.h>  /* for chdir, dup2, fork, setsid */
+
+#include <iostream>  /* for cerr, cout, endl */
+
+
+DEFINE_string(database, 'd', 0, "The history database to serve.");
+DEFINE_string(socket, 's', 0, "The UNIX socket to listen on.");
+
+DEFINE_flag(foreground, 'F', "Do not detach from the terminal.");
+DEFINE_flag(version, 'V', "Prints the version and exits.");
+
+
+using namespace ash;
+using namespace flag;
+using namespace std;
+
+
+/**
+ * Detaches from the controlling terminal, leaving a child process running.
+ */
+void daemonize() {
+  pid_t pid = fork();
+  if (pid < 0) LOG(FATAL) << "Failed to fork the daemon.";
+  if (pid > 0) exit(0);
+
+  setsid();
+  if (chdir("/")) LOG(WARNING) << "Failed to chdir to /";
+  int null = open("/dev/null", O_RDWR);
+  if (null >= 0) {
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    if (null > 2) close(null);
+  }
+}
+
+
+int main(int argc, char ** argv) {
+  Config & config = Config::instance();
+  Flag::parse(&argc, &argv, true);
+
+  if (FLAGS_version) {
+    cout << ASH_VERSION << endl;
+    return 0;
+  }
+
+  string db_file = FLAGS_database.empty()
+    ? config.get_string("HISTORY_DB")
+    : FLAGS_database;
+  if (db_file.empty()) {
+    cerr << "Expected either --database or ASH_CFG_HISTORY_DB to be defined."
+         << endl;
+    return 1;
+  }
+
+  string socket = FLAGS_socket.empty() ? Daemon::socket_name() : FLAGS_socket;
+  if (socket.empty()) {
+    cerr << "Expected either --socket or ASH_CFG_DAEMON_SOCKET to be defined."
+         << endl;
+    return 1;
+  }
+
+  // Register the tables expected in the program.
+  Session::register_table();
+  Command::register_table();
+  // Migrations too slow for the prompt are run here, while the daemon is idle.
+  Database::run_unchunked_migrations(true);
+
+  // Exit quietly if another daemon is already serving this socket.
+  Daemon daemon(db_file, socket);
+  if (!daemon.listen()) return 0;
+
+  if (!FLAGS_foreground) daemonize();
+  return daemon.serve();
+}
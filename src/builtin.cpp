@@ -0,0 +1,162 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "builtin.hpp"
+
+#include "command.hpp"
+#include "config.hpp"
+#include "logger.hpp"
+#include "recorder.hpp"
+#include "session.hpp"
+
+#include <unistd.h>  /* for getpid */
+
+
+using namespace ash;
+using namespace std;
+
+
+namespace {
+
+/**
+ * The Recorder of the shell that loaded this builtin.  It keeps the database
+ * open between prompts.
+ */
+Recorder * recorder = 0;
+
+
+/**
+ * The process that created the Recorder.
+ */
+pid_t owner = 0;
+
+
+/**
+ * Whether a FATAL error was logged since the logging core was last entered.
+ */
+bool failed = false;
+
+
+/**
+ * Installed as the fatal handler while the logging core is running, so a
+ * FATAL error returns (and the core returns an error) instead of exiting the
+ * user's shell.
+ */
+void on_fatal() {
+  failed = true;
+}
+
+
+/**
+ * Called on entering the logging core.
+ */
+void enter() {
+  failed = false;
+  Logger::set_fatal_handler(on_fatal);
+}
+
+
+/**
+ * Called on leaving the logging core, returning 0 if it succeeded.  After a
+ * FATAL error the Recorder is dropped, and the next call starts over with a
+ * new one.  Deleting it finalizes its statements and closes the connection,
+ * which rolls back anything left uncommitted.
+ */
+int leave(const bool ok) {
+  Logger::set_fatal_handler(0);
+  if (!failed) return ok ? 0 : 1;
+  Recorder * abandoned = recorder;
+  recorder = 0;
+  if (abandoned) delete abandoned;
+  return 1;
+}
+
+
+/**
+ * Returns the Recorder of this shell, creating it on first use.
+ */
+Recorder * get_recorder() {
+  // A subshell inherits the Recorder, but an sqlite connection must not be
+  // used (or closed) on both sides of a fork, so it gets a new one.
+  if (recorder && owner != getpid()) recorder = 0;
+  if (recorder) return recorder;
+
+  const string db_file = Config::instance().get_string("HISTORY_DB");
+  if (db_file.empty()) {
+    LOG(ERROR) << "Expected ASH_CFG_HISTORY_DB to be defined.";
+    return 0;
+  }
+
+  static bool registered = false;
+  if (!registered) {
+    Session::register_table();
+    Command::register_table();
+    registered = true;
+  }
+  recorder = new Recorder(db_file, getpid(), false);
+  owner = getpid();
+  return recorder;
+}
+
+}  // namespace
+
+
+/**
+ * Sets session_id to the current session id, inserting a new session if
+ * there is none.
+ */
+int ash_begin_session(long int * session_id) {
+  enter();
+  Recorder * r = get_recorder();
+  if (r) *session_id = r -> begin_session();
+  return leave(r && *session_id);
+}
+
+
+/**
+ * Ends the current session.
+ */
+int ash_end_session(void) {
+  enter();
+  Recorder * r = get_recorder();
+  if (r) r -> end_session();
+  return leave(r != 0);
+}
+
+
+/**
+ * Records a command entered in the current session.
+ */
+int ash_record(const char * command, int rval, long int start, long int end,
+               int number, const char * pipes)
+{
+  enter();
+  Recorder * r = get_recorder();
+  if (r) {
+    r -> record(command ? command : "", rval, start, end, number,
+                pipes ? pipes : "");
+  }
+  return leave(r != 0);
+}
+
+
+/**
+ * Closes the database before the builtin is unloaded.
+ */
+void ash_unload(void) {
+  if (recorder && owner == getpid()) delete recorder;
+  recorder = 0;
+}
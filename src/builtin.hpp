@@ -0,0 +1,44 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/**
+ * The C interface to the logging core, for shell builtins loaded into the
+ * user's shell.  The shells' plugin APIs are C, so this header must stay
+ * includable from C.
+ *
+ * Each function returns 0 on success.  Errors are logged, never fatal: a
+ * FATAL error abandons the shell's Recorder, and the next call starts over.
+ */
+#ifndef __ASH_BUILTIN__
+#define __ASH_BUILTIN__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+int ash_begin_session(long int * session_id);
+int ash_end_session(void);
+int ash_record(const char * command, int rval, long int start, long int end,
+               int number, const char * pipes);
+void ash_unload(void);
+
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* __ASH_BUILTIN__ */
@@ -0,0 +1,112 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+/*
+   Times the cold lookup of the process details a new session captures: the
+   shell's pid, its parent's pid and its name.  Each run forks a fresh process,
+   so nothing is remembered between runs, and the mean time per lookup is
+   printed in microseconds:
+
+     make bench [RUNS=500]
+
+   To compare with an earlier implementation, build it in a scratch worktree
+   against the unix.cpp of that revision, leaving this tree alone:
+
+     git worktree add --detach /tmp/ash-bench HEAD
+     git -C /tmp/ash-bench checkout REV -- src/unix.cpp
+     make -C /tmp/ash-bench/src bench
+     git worktree remove --force /tmp/ash-bench
+*/
+
+#include "capture_bench.hpp"
+
+#include "unix.hpp"
+
+#include <stdlib.h>    /* for atoi, exit */
+#include <sys/time.h>  /* for gettimeofday */
+#include <sys/wait.h>  /* for waitpid */
+#include <unistd.h>    /* for fork, pipe, read, write */
+
+#include <iostream>  /* for cerr, cout, endl */
+#include <string>
+
+
+using namespace ash;
+using namespace std;
+
+
+namespace {
+
+/**
+ * Returns the current time in microseconds.
+ */
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+
+/**
+ * Times one lookup in a fresh child process, which writes the elapsed time
+ * to the argument pipe.  Returns the time, or a negative value on failure.
+ */
+double time_capture(int fds[2]) {
+  const pid_t child = fork();
+  if (child < 0) return -1;
+  if (child == 0) {
+    const double start = now();
+    const long int shell_pid = unix::pid(), parent = unix::ppid();
+    const string name = unix::shell();
+    double elapsed = now() - start;
+    // Keep the lookups from being optimized away.
+    if (shell_pid < 0 || parent < 0 || name.size() > 4096) elapsed = -1;
+    exit(write(fds[1], &elapsed, sizeof(elapsed)) == sizeof(elapsed) ? 0 : 1);
+  }
+  double elapsed = -1;
+  if (read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) elapsed = -1;
+  waitpid(child, 0, 0);
+  return elapsed;
+}
+
+}  // namespace
+
+
+/**
+ * Prints the mean time of the capture over the argument number of runs.
+ */
+int main(int argc, char ** argv) {
+  const int runs = argc > 1 ? atoi(argv[1]) : ASH_BENCH_RUNS;
+  int fds[2];
+  if (runs <= 0 || pipe(fds)) {
+    cerr << "usage: " << argv[0] << " [RUNS]" << endl;
+    return 1;
+  }
+
+  double total = 0;
+  for (int i = 0; i < runs; ++i) {
+    const double elapsed = time_capture(fds);
+    if (elapsed < 0) {
+      cerr << "run " << i << " failed" << endl;
+      return 1;
+    }
+    total += elapsed;
+  }
+  cout << "capture " << total / runs << " us (mean of " << runs << " runs)"
+       << endl;
+  return 0;
+}
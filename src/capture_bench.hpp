@@ -0,0 +1,26 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef __ASH_CAPTURE_BENCH__
+#define __ASH_CAPTURE_BENCH__
+
+
+// The number of fresh processes timed, unless one is given on the command line.
+#define ASH_BENCH_RUNS 500
+
+
+#endif  /* __ASH_CAPTURE_BENCH__ */
@@ -16,8 +16,10 @@
 
 #include "command.hpp"
 
+#include "context.hpp"
+#include "logger.hpp"
 #include "unix.hpp"
-#include "util.hpp"
+
 
 #include <sstream>
 
@@ -26,20 +28,74 @@ using namespace ash;
 using std::stringstream;
 
 
+namespace {
+
 /**
- * Registers this table for use in the Database.
+ * The indexes of schema version 3, when command_log held the command texts.
  */
-void Command::register_table() {
-  string name = "commands";
+const char * const V3_INDEXES[][2] = {
+  {"command_log_session_id", "command_log (session_id, id)"},
+  {"command_log_dir_id", "command_log (dir_id)"},
+  {"command_log_start_time", "command_log (start_time)"},
+  {"command_log_failed", "command_log (start_time) WHERE rval != 0"},
+};
+const size_t V3_INDEX_COUNT = sizeof(V3_INDEXES) / sizeof(V3_INDEXES[0]);
+
+
+/**
+ * The indexes behind the saved queries: commands by session, by directory, by
+ * text and by time, and a partial index of the commands that failed.
+ * Directories are found through the unique index on their paths, and texts by
+ * their ids.
+ */
+const char * const INDEXES[][2] = {
+  {"command_runs_session_id", "command_runs (session_id, id)"},
+  {"command_runs_dir_id", "command_runs (dir_id)"},
+  {"command_runs_text_id", "command_runs (text_id)"},
+  {"command_runs_start_time", "command_runs (start_time)"},
+  {"command_runs_failed", "command_runs (start_time) WHERE rval != 0"},
+};
+const size_t INDEX_COUNT = sizeof(INDEXES) / sizeof(INDEXES[0]);
+
+
+/**
+ * Returns the SQL that creates an index, if it doesn't already exist.
+ */
+const string create_index(const char * const index[2]) {
   stringstream ss;
-  ss << "CREATE TABLE IF NOT EXISTS " << name << " (\n"
+  ss << "CREATE INDEX IF NOT EXISTS " << index[0] << " ON " << index[1] << ";";
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that creates the directories table, where each working
+ * directory is stored once.
+ */
+const string create_directories() {
+  return "CREATE TABLE IF NOT EXISTS directories (\n"
+         "  id integer primary key autoincrement,\n"
+         "  path varchar(256) not null,\n"
+         "UNIQUE(path)\n"
+         ");";
+}
+
+
+/**
+ * Returns the SQL that creates the tables of schema version 3, where
+ * command_log refers to working directories by id.
+ */
+const string create_command_log() {
+  stringstream ss;
+  ss << create_directories() << "\n"
+     << "CREATE TABLE IF NOT EXISTS command_log (\n"
      << "  id integer primary key autoincrement,\n"
      << "  session_id integer not null,\n"
      << "  shell_level integer not null,\n"
      << "  command_no integer,\n"
      << "  tty varchar(20) not null,\n"
      << "  euid int(16) not null,\n"
-     << "  cwd varchar(256) not null,\n"
+     << "  dir_id integer not null,\n"
      << "  rval int(5) not null,\n"
      << "  start_time integer not null,\n"
      << "  end_time integer not null,\n"
@@ -49,36 +105,419 @@ void Command::register_table() {
      << "  command varchar(1000) not null,\n"
      << "UNIQUE(session_id, command_no)\n"
      << ");";
-  DBObject::register_table(name, ss.str());
+  for (size_t i = 0; i < V3_INDEX_COUNT; ++i)
+    ss << "\n" << create_index(V3_INDEXES[i]);
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that creates the tables backing the commands view.  Each
+ * distinct command text is stored once in command_texts, keyed by its
+ * ash_hash, and command_runs refers to it and to the working directory by id.
+ */
+const string create_command_runs() {
+  stringstream ss;
+  ss << create_directories() << "\n"
+     << "CREATE TABLE IF NOT EXISTS command_texts (\n"
+     << "  id integer primary key,\n"
+     << "  text varchar(1000) not null\n"
+     << ");\n"
+     << "CREATE TABLE IF NOT EXISTS command_runs (\n"
+     << "  id integer primary key autoincrement,\n"
+     << "  session_id integer not null,\n"
+     << "  shell_level integer not null,\n"
+     << "  command_no integer,\n"
+     << "  tty varchar(20) not null,\n"
+     << "  euid int(16) not null,\n"
+     << "  dir_id integer not null,\n"
+     << "  rval int(5) not null,\n"
+     << "  start_time integer not null,\n"
+     << "  end_time integer not null,\n"
+     << "  duration integer not null,\n"
+     << "  pipe_cnt int(3),\n"
+     << "  pipe_vals varchar(80),\n"
+     << "  text_id integer not null,\n"
+     << "UNIQUE(session_id, command_no)\n"
+     << ");";
+  for (size_t i = 0; i < INDEX_COUNT; ++i)
+    ss << "\n" << create_index(INDEXES[i]);
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that creates the commands view of the argument schema
+ * version, which has the columns the commands table had before directories
+ * and texts were split out.  Rows inserted into the view have their directory
+ * and (from version 4) their text looked up, or added, by a trigger.
+ *
+ * Texts are keyed by hash, and a text whose hash is already taken by a
+ * different one is kept under the next free probe of it.  The trigger only
+ * refuses a text if every probe is taken, rather than log the wrong command.
+ */
+const string create_view(const int version) {
+  const bool texts = version >= 4;
+  stringstream ss;
+  ss << "CREATE VIEW IF NOT EXISTS commands AS\n"
+     << "SELECT\n"
+     << "  c.id AS id,\n"
+     << "  c.session_id AS session_id,\n"
+     << "  c.shell_level AS shell_level,\n"
+     << "  c.command_no AS command_no,\n"
+     << "  c.tty AS tty,\n"
+     << "  c.euid AS euid,\n"
+     << "  d.path AS cwd,\n"
+     << "  c.rval AS rval,\n"
+     << "  c.start_time AS start_time,\n"
+     << "  c.end_time AS end_time,\n"
+     << "  c.duration AS duration,\n"
+     << "  c.pipe_cnt AS pipe_cnt,\n"
+     << "  c.pipe_vals AS pipe_vals,\n"
+     << (texts ? "  t.text AS command\n" : "  c.command AS command\n")
+     << (texts ? "FROM command_runs AS c\n" : "FROM command_log AS c\n")
+     << "  INNER JOIN directories AS d ON d.id = c.dir_id"
+     << (texts ? "\n  INNER JOIN command_texts AS t ON t.id = c.text_id" : "")
+     << ";\n"
+     << "CREATE TRIGGER IF NOT EXISTS commands_insert\n"
+     << "INSTEAD OF INSERT ON commands\n"
+     << "BEGIN\n";
+  const string text_id =
+    Command::get_text_id_sql("NEW.command", "command_texts");
+  if (texts) {
+    const string free_id =
+      Command::get_free_text_id_sql("NEW.command", "command_texts");
+    ss << "  SELECT RAISE(ABORT, 'command text hash collision')\n"
+       << "    WHERE " << text_id << " IS NULL\n"
+       << "      AND " << free_id << " IS NULL;\n"
+       << "  INSERT INTO command_texts (id, text)\n"
+       << "    SELECT " << free_id << ", NEW.command\n"
+       << "    WHERE " << text_id << " IS NULL;\n";
+  }
+  ss << "  INSERT OR IGNORE INTO directories (path) VALUES (NEW.cwd);\n"
+     << (texts ? "  INSERT INTO command_runs" : "  INSERT INTO command_log")
+     << " (id, session_id, shell_level, command_no,\n"
+     << "    tty, euid, dir_id, rval, start_time, end_time, duration,\n"
+     << (texts ? "    pipe_cnt, pipe_vals, text_id)\n"
+               : "    pipe_cnt, pipe_vals, command)\n")
+     << "  VALUES (NEW.id, NEW.session_id, NEW.shell_level, NEW.command_no,\n"
+     << "    NEW.tty, NEW.euid,\n"
+     << "    (SELECT id FROM directories WHERE path = NEW.cwd),\n"
+     << "    NEW.rval, NEW.start_time, NEW.end_time, NEW.duration,\n"
+     << "    NEW.pipe_cnt, NEW.pipe_vals, "
+     << (texts ? text_id : "NEW.command") << ");\n"
+     << "END;";
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that creates the full-text index of command texts.  It is
+ * an external content FTS4 table: command_texts holds the texts and triggers
+ * keep the index up to date, so each distinct text is indexed once however
+ * often it is run.
+ */
+const string create_search() {
+  return "CREATE VIRTUAL TABLE IF NOT EXISTS command_search\n"
+         "  USING fts4(content=\"command_texts\", text);\n"
+         "CREATE TRIGGER IF NOT EXISTS command_texts_insert\n"
+         "AFTER INSERT ON command_texts\n"
+         "BEGIN\n"
+         "  INSERT INTO command_search (docid, text)\n"
+         "    VALUES (NEW.id, NEW.text);\n"
+         "END;\n"
+         "CREATE TRIGGER IF NOT EXISTS command_texts_delete\n"
+         "BEFORE DELETE ON command_texts\n"
+         "BEGIN\n"
+         "  DELETE FROM command_search WHERE docid = OLD.id;\n"
+         "END;";
+}
+
+
+/**
+ * Returns the SQL that interns the directories of rows in the old commands
+ * table that haven't been copied into command_log yet, stopping after limit
+ * rows if limit is given.
+ */
+const string intern_directories(const int limit) {
+  stringstream ss;
+  ss << "INSERT OR IGNORE INTO directories (path)\n"
+     << "  SELECT cwd FROM commands\n"
+     << "  WHERE id > (SELECT IFNULL(MAX(id), 0) FROM command_log)\n"
+     << "  ORDER BY id";
+  if (limit > 0) ss << " LIMIT " << limit;
+  ss << ";";
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that copies the rows of the old commands table into
+ * command_log, resuming after the last row copied and stopping after limit
+ * rows if limit is given.  Their directories must be interned first.
+ */
+const string copy_commands(const int limit) {
+  stringstream ss;
+  ss << "INSERT INTO command_log (id, session_id, shell_level, command_no,\n"
+     << "    tty, euid, dir_id, rval, start_time, end_time, duration,\n"
+     << "    pipe_cnt, pipe_vals, command)\n"
+     << "  SELECT id, session_id, shell_level, command_no, tty, euid,\n"
+     << "    (SELECT d.id FROM directories AS d WHERE d.path = commands.cwd),\n"
+     << "    rval, start_time, end_time, duration, pipe_cnt, pipe_vals,\n"
+     << "    command\n"
+     << "  FROM commands\n"
+     << "  WHERE id > (SELECT IFNULL(MAX(id), 0) FROM command_log)\n"
+     << "  ORDER BY id";
+  if (limit > 0) ss << " LIMIT " << limit;
+  ss << ";";
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that selects the next rows of command_log to be copied into
+ * command_runs, limited to limit rows if limit is given.
+ */
+const string next_command_log(const string & columns, const int limit) {
+  stringstream ss;
+  ss << "SELECT " << columns << " FROM command_log\n"
+     << "  WHERE id > (SELECT IFNULL(MAX(id), 0) FROM command_runs)\n"
+     << "  ORDER BY id";
+  if (limit > 0) ss << " LIMIT " << limit;
+  return ss.str();
+}
+
+
+/**
+ * Returns the SQL that interns the new texts of the rows of command_log that
+ * haven't been copied into command_runs yet.  Texts that collide with others
+ * interned by the same statement get the same probe, so it is run until no
+ * texts are missing (see count_missing_texts).
+ */
+const string intern_texts(const int limit) {
+  return "INSERT OR IGNORE INTO command_texts (id, text)\n"
+         "  SELECT id, command FROM (\n"
+         "    SELECT "
+    + Command::get_free_text_id_sql("command", "command_texts")
+    + " AS id, command\n"
+    + "    FROM (" + next_command_log("command", limit) + ")\n"
+    + "    WHERE " + Command::get_text_id_sql("command", "command_texts")
+    + " IS NULL)\n"
+    + "  WHERE id NOT NULL;";
+}
+
+
+/**
+ * Returns the SQL that counts the rows of command_log that haven't been
+ * copied yet whose texts haven't been interned.
+ */
+const string count_missing_texts(const int limit) {
+  return "SELECT COUNT(*) FROM (\n  "
+    + next_command_log("command", limit) + ")\n"
+    + "WHERE " + Command::get_text_id_sql("command", "command_texts")
+    + " IS NULL;";
+}
+
+
+/**
+ * Returns the SQL that copies the rows of command_log into command_runs.
+ * Their texts must be interned first.
+ */
+const string copy_command_log(const int limit) {
+  return "INSERT INTO command_runs (id, session_id, shell_level, command_no,\n"
+         "    tty, euid, dir_id, rval, start_time, end_time, duration,\n"
+         "    pipe_cnt, pipe_vals, text_id)\n  "
+    + next_command_log("id, session_id, shell_level, command_no, tty, euid,\n"
+                       "    dir_id, rval, start_time, end_time, duration,\n"
+                       "    pipe_cnt, pipe_vals, "
+                       + Command::get_text_id_sql("command", "command_texts"),
+                       limit)
+    + ";";
+}
+
+
+/**
+ * Returns the SQL that interns all the texts of command_log that haven't been
+ * copied, running intern_texts once for each probe.
+ */
+const string interned_texts() {
+  stringstream ss;
+  for (int i = 0; i < Command::TEXT_PROBES; ++i) {
+    ss << intern_texts(0) << "\n";
+  }
+  return ss.str();
+}
+
+
+/**
+ * A migration step that copies the next chunk of commands into command_log
+ * and returns the number of rows copied.
+ */
+long int copy_next_commands(Database & db, const int chunk) {
+  ResultSet * rs = db.exec(intern_directories(chunk));
+  if (rs) delete rs;
+  rs = db.exec(copy_commands(chunk));
+  if (rs) delete rs;
+  rs = db.exec("SELECT changes();");
+  const long int copied = rs && rs -> rows == 1
+    ? rs -> cell(0, 0).integer : -1;
+  if (rs) delete rs;
+  return copied;
+}
+
+
+/**
+ * A migration step that copies the next chunk of command_log into
+ * command_runs and returns the number of rows copied.  It only fails if more
+ * than Command::TEXT_PROBES texts share every probe, which 64-bit hashes
+ * make vanishingly unlikely.
+ */
+long int copy_next_command_log(Database & db, const int chunk) {
+  ResultSet * rs = 0;
+  long int missing = -1;
+  for (int i = 0; missing != 0 && i < Command::TEXT_PROBES; ++i) {
+    rs = db.exec(intern_texts(chunk));
+    if (rs) delete rs;
+    rs = db.exec(count_missing_texts(chunk));
+    missing = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : -1;
+    if (rs) delete rs;
+  }
+  if (missing != 0) {
+    LOG(ERROR) << missing << " command texts collide with "
+               << Command::TEXT_PROBES << " others";
+    return -1;
+  }
+
+  rs = db.exec(copy_command_log(chunk));
+  if (rs) delete rs;
+  rs = db.exec("SELECT changes();");
+  const long int copied = rs && rs -> rows == 1
+    ? rs -> cell(0, 0).integer : -1;
+  if (rs) delete rs;
+  return copied;
+}
+
+}  // namespace
+
+
+/**
+ * Returns an SQL expression for a free id to keep the argument text under in
+ * the argument texts table: the first of its ash_hash and then its probes
+ * ash_hash(text, 1), ash_hash(text, 2)... not already taken, or NULL if they
+ * all are.
+ */
+const string Command::get_free_text_id_sql(const string & text,
+                                           const string & texts)
+{
+  stringstream ss;
+  ss << "CASE";
+  for (int i = 0; i < TEXT_PROBES; ++i) {
+    stringstream probe;
+    probe << "ash_hash(" << text;
+    if (i) probe << ", " << i;
+    probe << ")";
+    ss << "\n  WHEN NOT EXISTS (SELECT 1 FROM " << texts << " WHERE id = "
+       << probe.str() << ") THEN " << probe.str();
+  }
+  ss << "\nEND";
+  return ss.str();
+}
+
+
+/**
+ * Returns an SQL expression for the id the argument text is kept under in the
+ * argument texts table, or NULL if it isn't there.  Its hash is looked up
+ * first, since that nearly always holds it.
+ */
+const string Command::get_text_id_sql(const string & text,
+                                      const string & texts)
+{
+  stringstream ss;
+  ss << "COALESCE(\n"
+     << "  (SELECT id FROM " << texts << " WHERE id = ash_hash(" << text
+     << ") AND text = " << text << "),\n"
+     << "  (SELECT id FROM " << texts << " WHERE id IN (";
+  for (int i = 1; i < TEXT_PROBES; ++i) {
+    ss << (i > 1 ? ", " : "") << "ash_hash(" << text << ", " << i << ")";
+  }
+  ss << ") AND text = " << text << "))";
+  return ss.str();
+}
+
+
+/**
+ * Registers this table for use in the Database.  Commands are kept in
+ * command_runs and read and written through the commands view, and their
+ * texts are searched through command_search.
+ */
+void Command::register_table() {
+  DBObject::register_table("commands", create_command_runs() + "\n"
+                           + create_view(4) + "\n" + create_search());
+  // The tables behind the view, for queries across shards.  Each text is
+  // kept in every shard that ran it.
+  DBObject::register_name("command_runs");
+  DBObject::register_name("directories");
+  DBObject::register_name("command_texts", true);
+
+  // Version 2 indexed the commands table, which the next migration replaces
+  // with command_log and its own indexes, so building them is wasted work.
+  DBObject::register_migration(
+    Migration(2, "index the commands table", "", "", ""));
+  DBObject::register_migration(
+    Migration(3, "intern the working directories of commands",
+              create_command_log(), "",
+              // Copy rows logged since the last chunk before the table goes.
+              intern_directories(0) + "\n" + copy_commands(0)
+                + "\nDROP TABLE commands;\n" + create_view(3),
+              copy_next_commands));
+  DBObject::register_migration(
+    Migration(4, "intern the texts of commands",
+              create_command_runs(), "",
+              interned_texts() + copy_command_log(0)
+                + "\nDROP VIEW commands;\nDROP TABLE command_log;\n"
+                + create_view(4),
+              copy_next_command_log));
+  // Rebuilding the search index of every text can't be chunked.
+  DBObject::register_migration(
+    Migration(5, "index the texts of commands for search", "", "",
+              create_search() + "\n"
+                + "INSERT INTO command_search (command_search)"
+                + " VALUES ('rebuild');",
+              0, true));
+  DBObject::register_migration(
+    Migration(6, "probe past the hashes of other command texts", "", "",
+              "DROP TRIGGER commands_insert;\n" + create_view(4)));
 }
 
 
 /**
- * Initializes a Command object by gathering various system data.
+ * Initializes a Command object by gathering various system data.  Values that
+ * are fixed for the whole session come from the saved session Context.
  */
-Command::Command(const string command, const int rval, const int start_ts,
-                 const int end_ts, const int number, const string pipes)
+Command::Command(const Context & context, const string command,
+                 const int rval, const int start_ts, const int end_ts,
+                 const int number, const string pipes)
 {
-  values["session_id"] = unix::env_int("ASH_SESSION_ID");
-  values["shell_level"] = unix::env_int("SHLVL");
-  values["command_no"] = Util::to_string(number);
-  values["tty"] = unix::tty();
-  values["euid"] = unix::euid();
+  set("session_id", context.session_id);
+  set("shell_level", context.shell_level);
+  set("command_no", number);
+  set("tty", context.tty);
+  set("euid", context.euid);
   if (rval == 0 && command.find("cd") == 0) {
-    values["cwd"] = unix::env("OLDPWD");
+    set("cwd", unix::env("OLDPWD"));
   } else {
-    values["cwd"] = unix::cwd();
+    set("cwd", unix::cwd());
   }
-  values["rval"] = Util::to_string(rval);
-  values["start_time"] = Util::to_string(start_ts);
-  values["end_time"] = Util::to_string(end_ts);
-  values["duration"] = Util::to_string(end_ts - start_ts);
+  set("rval", rval);
+  set("start_time", start_ts);
+  set("end_time", end_ts);
+  set("duration", end_ts - start_ts);
   int pipe_cnt = 1;
   for (string::const_iterator i = pipes.begin(), e = pipes.end(); i != e; ++i)
     if ((*i) == '_') ++pipe_cnt;
-  values["pipe_cnt"] = Util::to_string(pipe_cnt);
-  values["pipe_vals"] = quote(pipes);
-  values["command"] = quote(command);
+  set("pipe_cnt", pipe_cnt);
+  set("pipe_vals", pipes);
+  set("command", command);
 }
 
 
@@ -25,17 +25,28 @@ using std::string;
 
 namespace ash {
 
+class Context;  // Forward declaration.
+
 
 /**
  * This class represents a user-entered command to be saved in the database.
  */
 class Command : public DBObject {
   public:
+    // The number of ids a text may be kept under (see get_free_text_id_sql).
+    static const int TEXT_PROBES = 4;
+
+  public:
+    static const string get_free_text_id_sql(const string & text,
+                                             const string & texts);
+    static const string get_text_id_sql(const string & text,
+                                        const string & texts);
     static void register_table();
 
   public:
-    Command(const string command, const int rval, const int start,
-            const int end, const int num, const string pipes);
+    Command(const Context & context, const string command, const int rval,
+            const int start, const int end, const int num,
+            const string pipes);
     virtual ~Command();
 
     virtual const string get_name() const;
@@ -0,0 +1,162 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "context.hpp"
+
+#include "config.hpp"
+#include "logger.hpp"
+#include "unix.hpp"
+
+#include <errno.h>     /* for errno */
+#include <fcntl.h>     /* for open */
+#include <stdio.h>     /* for rename */
+#include <stdlib.h>    /* for mkstemp */
+#include <string.h>    /* for memcmp, memcpy, memset, strerror */
+#include <sys/mman.h>  /* for mmap, munmap */
+#include <sys/stat.h>  /* for fstat */
+#include <unistd.h>    /* for close, unlink, write */
+
+#include <sstream>
+
+
+using namespace ash;
+using namespace std;
+
+
+namespace {
+
+/**
+ * The on-disk layout of a saved context.  The file is only ever read by the
+ * same build on the same machine, so no care is taken over byte order.
+ */
+struct Layout {
+  char magic[8];
+  long int session_id, shell_pid, shell_level, euid;
+  char tty[64];
+};
+
+const char MAGIC[8] = "ASHCTX1";
+
+}  // namespace
+
+
+/**
+ * Deletes the saved context of a shell.
+ */
+void Context::remove(const long int session_id, const long int shell_pid) {
+  const string file = filename(session_id, shell_pid);
+  if (unlink(file.c_str()) && errno != ENOENT) {
+    LOG(WARNING) << "Failed to remove " << file << ": " << strerror(errno);
+  }
+}
+
+
+/**
+ * Returns the file that holds the context of one shell in a session.
+ */
+const string Context::filename(const long int session_id,
+                               const long int shell_pid)
+{
+  string dir = Config::instance().get_string("RUNTIME_DIR");
+  if (dir.empty()) dir = unix::env("XDG_RUNTIME_DIR");
+  if (dir.empty()) dir = "/tmp";
+  stringstream ss;
+  ss << dir << "/ash-" << unix::euid() << "-" << session_id << "-" << shell_pid
+     << ".ctx";
+  return ss.str();
+}
+
+
+/**
+ * Loads the context for the argument shell, deriving it from the system if no
+ * valid one has been saved.
+ */
+Context::Context(const long int session_id, const long int shell_pid)
+  : session_id(session_id), shell_pid(shell_pid), shell_level(0), euid(0)
+{
+  const string file = filename(session_id, shell_pid);
+  if (load(file)) return;
+
+  LOG(DEBUG) << "Deriving the session context for " << file;
+  shell_level = unix::env_int("SHLVL");
+  euid = unix::euid();
+  tty = unix::tty();
+  if (session_id) save(file);
+}
+
+
+/**
+ * Reads a saved context by mapping the file.  Returns false if the file is
+ * missing, not ours, or was saved for a different session or shell.
+ */
+bool Context::load(const string & file) {
+  int fd = open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  void * map = MAP_FAILED;
+  struct stat st;
+  if (!fstat(fd, &st) && st.st_uid == geteuid()
+      && st.st_size == sizeof(Layout))
+  {
+    map = mmap(0, sizeof(Layout), PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const Layout * saved = (const Layout *) map;
+  bool valid = !memcmp(saved -> magic, MAGIC, sizeof(MAGIC))
+    && saved -> session_id == session_id
+    && saved -> shell_pid == shell_pid
+    && saved -> tty[sizeof(saved -> tty) - 1] == '\0';
+  if (valid) {
+    shell_level = saved -> shell_level;
+    euid = saved -> euid;
+    tty = saved -> tty;
+  }
+  munmap(map, sizeof(Layout));
+  return valid;
+}
+
+
+/**
+ * Writes this context to the argument file.  The file is replaced atomically
+ * so a concurrent reader never maps a partial write.
+ */
+void Context::save(const string & file) const {
+  Layout layout;
+  memset(&layout, 0, sizeof(layout));
+  memcpy(layout.magic, MAGIC, sizeof(MAGIC));
+  layout.session_id = session_id;
+  layout.shell_pid = shell_pid;
+  layout.shell_level = shell_level;
+  layout.euid = euid;
+  strncpy(layout.tty, tty.c_str(), sizeof(layout.tty) - 1);
+
+  string temp = file + ".XXXXXX";
+  int fd = mkstemp(&temp[0]);
+  if (fd < 0) {
+    LOG(INFO) << "Failed to save the session context " << file << ": "
+              << strerror(errno);
+    return;
+  }
+  bool written = write(fd, &layout, sizeof(layout)) == sizeof(layout);
+  close(fd);
+  if (!written || rename(temp.c_str(), file.c_str())) {
+    LOG(INFO) << "Failed to save the session context " << file << ": "
+              << strerror(errno);
+    unlink(temp.c_str());
+  }
+}
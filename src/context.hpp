@@ -0,0 +1,66 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_CONTEXT__
+#define __ASH_CONTEXT__
+
+#include <string>
+
+using std::string;
+
+namespace ash {
+
+
+/**
+ * The values of a shell session that never change between prompts.
+ *
+ * They are derived once per shell and saved in a small file in the runtime
+ * directory, so later _ash_log invocations map them back in rather than asking
+ * the system again.  Each shell process has its own file, since nested shells
+ * share an ASH_SESSION_ID but not a tty or shell level.
+ */
+class Context {
+  // STATIC:
+  public:
+    static void remove(const long int session_id, const long int shell_pid);
+
+  private:
+    static const string filename(const long int session_id,
+                                 const long int shell_pid);
+
+  // NON-STATIC:
+  public:
+    Context(const long int session_id, const long int shell_pid);
+    ~Context() {}
+
+  private:
+    bool load(const string & file);
+    void save(const string & file) const;
+
+  public:
+    long int session_id, shell_pid, shell_level, euid;
+    string tty;
+
+  // DISALLOWED:
+  private:
+    Context(const Context & other);
+    Context & operator = (const Context & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_CONTEXT__ */
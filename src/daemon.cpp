@@ -0,0 +1,634 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "daemon.hpp"
+
+#include "config.hpp"
+#include "database.hpp"
+#include "logger.hpp"
+#include "shards.hpp"
+#include "util.hpp"
+
+#include <errno.h>       /* for errno */
+#include <fcntl.h>       /* for open */
+#include <poll.h>        /* for poll */
+#include <signal.h>      /* for signal */
+#include <stdlib.h>      /* for atol */
+#include <string.h>      /* for strerror, strncpy */
+#include <sys/file.h>    /* for flock */
+#include <sys/socket.h>  /* for socket, bind, connect */
+#include <sys/stat.h>    /* for lstat, umask */
+#include <sys/time.h>    /* for timeval */
+#include <sys/un.h>      /* for sockaddr_un */
+#include <unistd.h>      /* for close, read, write, unlink */
+
+#include <sstream>
+#include <vector>
+
+
+using namespace ash;
+using namespace std;
+
+
+/**
+ * Request types understood by the daemon.  Each request is a sequence of
+ * netstrings: the type, the database filename and then the type-specific
+ * fields.  Clients send one request per connection and half-close the socket.
+ */
+static const char PING = 'P';     // No fields.
+static const char INSERT = 'I';   // Table name, then column / value pairs.
+static const char SESSION = 'S';  // Like INSERT, but replies with the ROWID.
+static const char EXEC = 'X';     // A single SQL statement.
+
+
+/**
+ * Set by the signal handler when the daemon has been asked to exit.
+ */
+static volatile sig_atomic_t stopping = 0;
+
+
+/**
+ * Records that a terminating signal was received.
+ */
+static void stop(int signal) {
+  stopping = 1;
+}
+
+
+/**
+ * Appends a field to a message as a netstring: <length>:<bytes>,
+ */
+static void put(string & out, const string & field) {
+  out += Util::to_string(field.size());
+  out += ':';
+  out += field;
+  out += ',';
+}
+
+
+/**
+ * Reads the next netstring from a message, advancing pos past it.  Returns
+ * false if the message is truncated or malformed.
+ */
+static bool take(const string & in, size_t & pos, string & field) {
+  size_t colon = in.find(':', pos);
+  if (colon == string::npos || colon == pos) return false;
+  size_t length = 0;
+  for (size_t i = pos; i < colon; ++i) {
+    if (in[i] < '0' || in[i] > '9') return false;
+    length = length * 10 + (in[i] - '0');
+  }
+  if (colon + length + 1 >= in.size() || in[colon + length + 1] != ',')
+    return false;
+  field = in.substr(colon + 1, length);
+  pos = colon + length + 2;
+  return true;
+}
+
+
+/**
+ * Encodes a column value as its type code followed by the value: n for null,
+ * i<digits> for integers and t<bytes> for text.
+ */
+static const string encode(const Value & value) {
+  switch (value.type) {
+    case Value::INTEGER: return "i" + Util::to_string(value.integer);
+    case Value::TEXT: return "t" + value.text;
+    case Value::NONE:  // fallthrough
+    default: return "n";
+  }
+}
+
+
+/**
+ * Decodes a column value written by encode.
+ */
+static const Value decode(const string & field) {
+  if (field.empty()) return Value();
+  switch (field[0]) {
+    case 'i': return Value(atol(field.c_str() + 1));
+    case 't': return Value(field.substr(1));
+    default: return Value();
+  }
+}
+
+
+/**
+ * Writes the entire buffer to a file descriptor, retrying short writes.
+ */
+static bool write_all(int fd, const string & data) {
+  for (size_t done = 0; done < data.size(); ) {
+    ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+  return true;
+}
+
+
+/**
+ * Fills a UNIX socket address, returning false if the path is too long.
+ */
+static bool socket_address(const string & path, struct sockaddr_un & address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return true;
+}
+
+
+namespace ash {
+
+/**
+ * A DBObject rebuilt from the fields of a client request, or a statement to
+ * execute in its place.
+ */
+class Record : public DBObject {
+  public:
+    Record(const string & name, const string & statement="")
+      : sql(statement), table(name) {}
+    virtual ~Record() {}
+
+    virtual const string get_name() const { return table; }
+
+    void set(const string & column, const Value & value) {
+      values[column] = value;
+    }
+
+  public:
+    const string sql;
+
+  private:
+    const string table;
+};
+
+}  // namespace ash
+
+
+/**
+ * Returns the configured socket path, or an empty string if the daemon is not
+ * configured.
+ */
+const string Daemon::socket_name() {
+  return Config::instance().get_string("DAEMON_SOCKET");
+}
+
+
+/**
+ * Sends a request to the daemon and reads the reply.  Returns false if the
+ * request could not be delivered.  The reply may be empty if the daemon
+ * accepted the request but did not answer in time.
+ */
+bool Daemon::request(const string & message, string & reply) {
+  const string path = socket_name();
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) return false;
+
+  // Refuse to talk to a socket that is owned by anyone else.
+  struct stat st;
+  if (lstat(path.c_str(), &st) || !S_ISSOCK(st.st_mode)) return false;
+  if (st.st_uid != geteuid()) {
+    LOG(WARNING) << "Ignoring daemon socket owned by uid " << st.st_uid
+                 << ": " << path;
+    return false;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address))) {
+    LOG(DEBUG) << "Daemon is not running at " << path << ": "
+               << strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  // Never let a wedged daemon hang the prompt.
+  int timeout_ms = Config::instance().get_int("DAEMON_TIMEOUT", 2000);
+  struct timeval timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if (!write_all(fd, message) || shutdown(fd, SHUT_WR)) {
+    LOG(WARNING) << "Failed to send a request to the daemon: "
+                 << strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  reply.clear();
+  char buffer[256];
+  for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) != 0; ) {
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      LOG(WARNING) << "No reply from the daemon: " << strerror(errno);
+      break;
+    }
+    reply.append(buffer, n);
+  }
+  close(fd);
+  return true;
+}
+
+
+/**
+ * Returns true if a daemon is answering on the configured socket.
+ */
+bool Daemon::is_running() {
+  string message, reply, status;
+  put(message, string(1, PING));
+  put(message, "");
+  size_t pos = 0;
+  return request(message, reply) && take(reply, pos, status) && status == "ok";
+}
+
+
+/**
+ * Queues an insert of a DBObject.  If id is not null, the daemon writes the
+ * row immediately and the new ROWID is stored in id.
+ */
+bool Daemon::insert(const string & db_file, const DBObject & object,
+                    long int * id)
+{
+  string message, reply, status, value;
+  put(message, string(1, id ? SESSION : INSERT));
+  put(message, db_file);
+  put(message, object.get_name());
+  typedef map<string, Value>::const_iterator c_iter;
+  for (c_iter i = object.values.begin(), e = object.values.end(); i != e; ++i) {
+    put(message, i -> first);
+    put(message, encode(i -> second));
+  }
+
+  if (!request(message, reply)) return false;
+
+  size_t pos = 0;
+  if (!take(reply, pos, status) || !take(reply, pos, value)) {
+    // The daemon has the row, but a session id can't be handed out without a
+    // reply.  The caller then writes the session itself, which only adds a
+    // row if the daemon hasn't (see Database::insert_session).
+    return id == 0;
+  }
+  if (status != "ok") {
+    LOG(WARNING) << "Daemon refused an insert: " << value;
+    return false;
+  }
+  if (id) *id = atol(value.c_str());
+  return true;
+}
+
+
+/**
+ * Queues a SQL statement to be executed with the next batch.
+ */
+bool Daemon::exec(const string & db_file, const string & sql) {
+  string message, reply, status, value;
+  put(message, string(1, EXEC));
+  put(message, db_file);
+  put(message, sql);
+
+  if (!request(message, reply)) return false;
+
+  size_t pos = 0;
+  if (take(reply, pos, status) && take(reply, pos, value) && status != "ok") {
+    LOG(WARNING) << "Daemon refused a statement: " << value;
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Creates a daemon that will serve the argument database on a socket.
+ */
+Daemon::Daemon(const string & file, const string & socket)
+  : db_file(file), path(socket), db(0), listener(-1), lock(-1), clients(),
+    pending(), deadline(0)
+{
+  // Nothing to do.
+}
+
+
+/**
+ * Writes any pending rows and releases the socket.
+ */
+Daemon::~Daemon() {
+  if (db) {
+    flush();
+    delete db;
+    db = 0;
+  }
+  typedef list<Record *>::iterator r_iter;
+  for (r_iter i = pending.begin(), e = pending.end(); i != e; ++i) delete *i;
+  typedef map<int, string>::iterator iter;
+  for (iter i = clients.begin(), e = clients.end(); i != e; ++i)
+    close(i -> first);
+  if (listener >= 0) {
+    close(listener);
+    unlink(path.c_str());
+  }
+  if (lock >= 0) close(lock);
+}
+
+
+/**
+ * Binds the listening socket.  Returns false if another daemon already owns
+ * the socket or it cannot be created.
+ */
+bool Daemon::listen() {
+  struct sockaddr_un address;
+  if (!socket_address(path, address)) {
+    LOG(ERROR) << "Invalid daemon socket path: '" << path << "'";
+    return false;
+  }
+
+  // A lock file next to the socket keeps two daemons from racing to bind.
+  const string lock_file = path + ".lock";
+  lock = open(lock_file.c_str(), O_RDWR | O_CREAT, 0600);
+  if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB)) {
+    LOG(INFO) << "Another daemon holds " << lock_file;
+    return false;
+  }
+
+  // Any socket file still present at this point was left by a dead daemon.
+  unlink(path.c_str());
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    LOG(ERROR) << "Failed to create a socket: " << strerror(errno);
+    return false;
+  }
+
+  mode_t mask = umask(077);
+  int bound = bind(listener, (struct sockaddr *) &address, sizeof(address));
+  umask(mask);
+  if (bound || ::listen(listener, 64)) {
+    LOG(ERROR) << "Failed to listen on " << path << ": " << strerror(errno);
+    close(listener);
+    listener = -1;
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Accepts a pending client connection.
+ */
+void Daemon::accept_client() {
+  int client = accept(listener, 0, 0);
+  if (client < 0) {
+    if (errno != EINTR && errno != EAGAIN)
+      LOG(WARNING) << "Failed to accept a client: " << strerror(errno);
+    return;
+  }
+#ifdef SO_PEERCRED
+  struct ucred peer;
+  socklen_t size = sizeof(peer);
+  if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &size)
+      || peer.uid != geteuid())
+  {
+    LOG(WARNING) << "Rejected a client connection from another user.";
+    close(client);
+    return;
+  }
+#endif  /* SO_PEERCRED */
+  clients[client] = "";
+}
+
+
+/**
+ * Reads available request bytes from a client.  Once the client half-closes
+ * the connection the request is handled, answered and the client is closed.
+ */
+void Daemon::read_client(int client) {
+  char buffer[4096];
+  ssize_t n = read(client, buffer, sizeof(buffer));
+  if (n < 0 && errno == EINTR) return;
+  if (n > 0) {
+    clients[client].append(buffer, n);
+    return;
+  }
+  if (n == 0) write_all(client, handle(clients[client]));
+  close(client);
+  clients.erase(client);
+}
+
+
+/**
+ * Applies a single client request and returns the reply to send back.
+ */
+const string Daemon::handle(const string & message) {
+  string reply, type, file, name;
+  size_t pos = 0;
+  if (!take(message, pos, type) || type.size() != 1
+      || !take(message, pos, file))
+  {
+    put(reply, "error");
+    put(reply, "malformed request");
+    return reply;
+  }
+
+  if (type[0] == PING) {
+    put(reply, "ok");
+    put(reply, db_file);
+    return reply;
+  }
+
+  // Refuse rows meant for a different history database.
+  if (file != db_file) {
+    put(reply, "error");
+    put(reply, "serving " + db_file);
+    return reply;
+  }
+
+  if (!take(message, pos, name)) {
+    put(reply, "error");
+    put(reply, "missing table name");
+    return reply;
+  }
+
+  if (type[0] != EXEC && type[0] != INSERT && type[0] != SESSION) {
+    put(reply, "error");
+    put(reply, "unknown request type");
+    return reply;
+  }
+
+  if (type[0] == EXEC) {
+    if (pending.empty()) deadline = Util::now_ms();
+    pending.push_back(new Record("", name));
+    put(reply, "ok");
+    put(reply, "");
+    return reply;
+  }
+
+  Record * record = new Record(name);
+  for (string column, value; take(message, pos, column); ) {
+    if (!take(message, pos, value)) break;
+    record -> set(column, decode(value));
+  }
+
+  if (type[0] == SESSION) {
+    // Session ids are needed right away, so write everything now.  If that
+    // fails the shell writes the session itself.
+    if (!flush()) {
+      put(reply, "error");
+      put(reply, "database is locked");
+    } else {
+      put(reply, "ok");
+      put(reply, Util::to_string(db -> insert_session(record)));
+    }
+    delete record;
+    return reply;
+  }
+
+  if (pending.empty()) deadline = Util::now_ms();
+  pending.push_back(record);
+  put(reply, "ok");
+  put(reply, "");
+  return reply;
+}
+
+
+/**
+ * Writes all pending rows in a single transaction.  If the database stays
+ * locked, or the commit fails, the rows are kept to retry with the next batch
+ * and false is returned.
+ */
+bool Daemon::flush() {
+  if (pending.empty()) return true;
+
+  open_current();
+  LOG(DEBUG) << "Flushing " << pending.size() << " pending statements.";
+  if (!db -> begin()) {
+    deadline = Util::now_ms();
+    return false;
+  }
+  typedef list<Record *>::iterator iter;
+  for (iter i = pending.begin(), e = pending.end(); i != e; ++i) {
+    if ((*i) -> sql.empty()) {
+      db -> insert(*i);
+    } else {
+      ResultSet * rs = db -> exec((*i) -> sql);
+      if (rs) delete rs;
+    }
+  }
+  if (!db -> commit()) {
+    deadline = Util::now_ms();
+    return false;
+  }
+  for (iter i = pending.begin(), e = pending.end(); i != e; ++i) delete *i;
+  pending.clear();
+  db -> checkpoint();
+  return true;
+}
+
+
+/**
+ * Opens the database that new rows are written to, if it isn't open already.
+ * If the history is sharded by month, this is a new file each month.
+ */
+void Daemon::open_current() {
+  const string file = Shards::current(db_file);
+  if (db && db -> filename() == file) return;
+  if (db) delete db;
+  db = new Database(file);
+  LOG(INFO) << "Writing to " << file;
+}
+
+
+/**
+ * Serves client requests until a terminating signal arrives or the daemon has
+ * been idle for ASH_CFG_DAEMON_IDLE_TIMEOUT seconds.
+ */
+int Daemon::serve() {
+  if (listener < 0) return 1;
+
+  Config & config = Config::instance();
+  const long int flush_ms = config.get_int("DAEMON_FLUSH_MS", 100);
+  const size_t max_batch = config.get_int("DAEMON_MAX_BATCH", 500);
+  const long int idle_ms = config.get_int("DAEMON_IDLE_TIMEOUT", 3600) * 1000L;
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  LOG(INFO) << "Serving " << db_file << " on " << path;
+  open_current();
+
+  // Schema migrations that didn't finish when the database was opened carry
+  // on whenever no rows are pending.
+  bool migrating = !db -> migrate();
+
+  vector<struct pollfd> fds;
+  long int active = Util::now_ms();
+  while (!stopping) {
+    fds.clear();
+    struct pollfd fd = {listener, POLLIN, 0};
+    fds.push_back(fd);
+    typedef map<int, string>::iterator iter;
+    for (iter i = clients.begin(), e = clients.end(); i != e; ++i) {
+      fd.fd = i -> first;
+      fds.push_back(fd);
+    }
+
+    // Sleep until the current batch is due, or the idle timeout passes.
+    long int now = Util::now_ms(), timeout = -1;
+    if (!pending.empty()) {
+      timeout = deadline + flush_ms - now;
+    } else if (idle_ms > 0 && clients.empty()) {
+      timeout = active + idle_ms - now;
+      if (timeout <= 0) {
+        LOG(INFO) << "Exiting after " << idle_ms / 1000 << " idle seconds.";
+        break;
+      }
+    }
+    if (!pending.empty() && timeout < 0) timeout = 0;
+    if (migrating && pending.empty() && (timeout < 0 || timeout > flush_ms)) {
+      timeout = flush_ms;
+    }
+
+    if (poll(&fds[0], fds.size(), timeout) < 0 && errno != EINTR) {
+      LOG(ERROR) << "poll failed: " << strerror(errno);
+      break;
+    }
+
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (fds[i].revents) read_client(fds[i].fd);
+    }
+    if (fds[0].revents & POLLIN) {
+      accept_client();
+      active = Util::now_ms();
+    }
+
+    now = Util::now_ms();
+    if (!pending.empty()
+        && (pending.size() >= max_batch || now >= deadline + flush_ms))
+    {
+      flush();
+    }
+    if (migrating && pending.empty()) migrating = !db -> migrate();
+  }
+  if (!flush()) {
+    LOG(ERROR) << "Exiting with " << pending.size() << " unwritten rows.";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_DAEMON__
+#define __ASH_DAEMON__
+
+#include <list>
+#include <map>
+#include <string>
+
+using std::list;
+using std::map;
+using std::string;
+
+namespace ash {
+
+class Database;  // Forward declaration.
+class DBObject;  // Forward declaration.
+class Record;  // Forward declaration.
+
+
+/**
+ * A long-running logger that keeps the history database open and accepts
+ * records from _ash_log over a UNIX domain socket.  Pending rows are written
+ * in a single transaction once per flush window.
+ *
+ * The static methods are the client half: each returns false if the daemon is
+ * not reachable, so callers can fall back to writing the database directly.
+ */
+class Daemon {
+  // STATIC:
+  public:
+    static bool exec(const string & db_file, const string & sql);
+    static bool insert(const string & db_file, const DBObject & object,
+                       long int * id=0);
+    static bool is_running();
+    static const string socket_name();
+
+  private:
+    static bool request(const string & message, string & reply);
+
+  // NON-STATIC:
+  public:
+    Daemon(const string & db_file, const string & socket);
+    ~Daemon();
+
+    bool listen();
+    int serve();
+
+  private:
+    void accept_client();
+    bool flush();
+    const string handle(const string & message);
+    void open_current();
+    void read_client(int client);
+
+  private:
+    const string db_file, path;
+    Database * db;
+    int listener, lock;
+    map<int, string> clients;
+    list<Record *> pending;
+    long int deadline;
+
+  // DISALLOWED:
+  private:
+    Daemon(const Daemon & other);
+    Daemon & operator = (const Daemon & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_DAEMON__ */
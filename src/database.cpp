@@ -18,16 +18,21 @@
 
 #include "config.hpp"
 #include "logger.hpp"
+#include "shards.hpp"
+#include "util.hpp"
 
+#include <ctype.h>     /* for toupper */
 #include <errno.h>     /* for errno */
+#include <fcntl.h>     /* for open */
+#include <float.h>     /* for DBL_MAX */
+#include <math.h>      /* for log */
+#include <sys/file.h>  /* for flock */
 #include <sys/stat.h>  /* for stat */
-#include <sys/time.h>  /* for timeval */
 #include <stdio.h>     /* for fopen */
-#include <stdlib.h>    /* for rand, srand */
-#include <string.h>    /* for strerror */
-#include <time.h>      /* for time */
-#include <unistd.h>    /* for getpid */
+#include <string.h>    /* for memcmp, strerror */
+#include <unistd.h>    /* for access, close, unlink */
 
+#include <algorithm>
 #include <iostream>
 #include <list>
 #include <sstream>
@@ -46,6 +51,11 @@ using namespace ash;
 using namespace std;
 
 
+// sqlite's defaults, as it is built here (see SQL_FLAGS in the Makefile).
+static const int DEFAULT_JOURNAL_SIZE_LIMIT = 4 << 20;
+static const int DEFAULT_WAL_AUTOCHECKPOINT = 1000;
+
+
 /**
  * A list of the registered tables names for the DB.
  */
@@ -59,23 +69,311 @@ list<string> DBObject::create_tables;
 
 
 /**
- * Initialize a ResultSet.
+ * The registered tables whose rows are shared between shards.
+ */
+std::set<string> DBObject::distinct_names;
+
+
+/**
+ * The registered schema migrations, keyed by the version they stamp.
+ */
+map<int, Migration> DBObject::migrations;
+
+
+/**
+ * CELL CODE BELOW:
+ */
+
+
+/**
+ * Writes a real the way sqlite turns it into text, with at least one digit
+ * after the decimal point, into the argument buffer.  Returns its length.
+ */
+static size_t format_real(const double real, char * buffer) {
+  if (real > DBL_MAX || real < -DBL_MAX) {
+    strcpy(buffer, real < 0 ? "-Inf" : "Inf");
+    return strlen(buffer);
+  }
+  size_t length = snprintf(buffer, 32, "%.15g", real);
+  if (strchr(buffer, '.') || strchr(buffer, 'n')) return length;
+  char * e = strchr(buffer, 'e');
+  const size_t at = e ? e - buffer : length;
+  memmove(buffer + at + 2, buffer + at, length - at + 1);
+  buffer[at] = '.';
+  buffer[at + 1] = '0';
+  return length + 2;
+}
+
+
+/**
+ * Returns the text of this cell.  Numbers are written into the argument
+ * buffer, which must hold at least 32 bytes.  The length of the text is
+ * returned in the argument length, since text may hold NUL bytes.
+ */
+const char * Cell::to_text(char * buffer, size_t & length) const {
+  switch (type) {
+    case INTEGER:
+      length = Util::format(integer, buffer);
+      return buffer;
+    case REAL:
+      length = format_real(real, buffer);
+      return buffer;
+    case TEXT:
+      length = size;
+      return text;
+    case NONE:  // fallthrough
+    default:
+      length = 0;
+      return "";
+  }
+}
+
+
+/**
+ * Returns the text of this cell as a string.
+ */
+const string Cell::str() const {
+  char buffer[32];
+  size_t length = 0;
+  const char * bytes = to_text(buffer, length);
+  return string(bytes, length);
+}
+
+
+/**
+ * Returns the length of the text of this cell.
+ */
+size_t Cell::width() const {
+  if (type == TEXT) return size;
+  char buffer[32];
+  size_t length = 0;
+  to_text(buffer, length);
+  return length;
+}
+
+
+/**
+ * Returns true if the cells print the same text.  Cells of the same type are
+ * compared without turning numbers into text.
+ */
+bool Cell::operator == (const Cell & other) const {
+  if (type == other.type) {
+    switch (type) {
+      case INTEGER: return integer == other.integer;
+      case REAL: return real == other.real;
+      case TEXT: return size == other.size && !memcmp(text, other.text, size);
+      default: return true;
+    }
+  }
+  char a[32], b[32];
+  size_t m = 0, n = 0;
+  const char * x = to_text(a, m), * y = other.to_text(b, n);
+  return m == n && !memcmp(x, y, m);
+}
+
+
+/**
+ * Inserts the text of a cell, padded to the width of the stream (which is
+ * then reset, as for any formatted output).
+ */
+ostream & ash::operator << (ostream & out, const Cell & cell) {
+  char buffer[32];
+  size_t length = 0;
+  const char * text = cell.to_text(buffer, length);
+  const size_t width = out.width(0);
+  size_t pad = width > length ? width - length : 0;
+  const bool left = (out.flags() & ios::adjustfield) == ios::left;
+  if (!left) for (; pad; --pad) out.put(out.fill());
+  out.write(text, length);
+  if (out.fill() == ' ') {
+    static const char spaces[] = "                                ";
+    for (size_t n; pad; pad -= n) {
+      n = min(pad, sizeof(spaces) - 1);
+      out.write(spaces, n);
+    }
+  }
+  for (; pad; --pad) out.put(out.fill());
+  return out;
+}
+
+
+/**
+ * RESULT_SET CODE BELOW:
  */
-ResultSet::ResultSet(const HeadersType & h, const DataType & d)
+
+
+/**
+ * Appends a cell to the argument rows, copying its text to the end of the
+ * argument arena.  Until the rows are given to a ResultSet, a text cell holds
+ * the offset of its text in the arena, since the arena moves as it grows.
+ */
+void ResultSet::append(DataType & data, ArenaType & arena, const Cell & cell) {
+  data.push_back(cell);
+  if (cell.type != Cell::TEXT) return;
+  data.back().integer = arena.size();
+  arena.insert(arena.end(), cell.text, cell.text + cell.size);
+}
+
+
+/**
+ * Initialize a ResultSet, taking the rows and the arena holding their text
+ * from the arguments, which are left empty.
+ */
+ResultSet::ResultSet(const HeadersType & h, DataType & d, ArenaType & a)
   : headers(h),
-    data(d),
-    rows(d.size()),
+    rows(h.empty() ? 0 : d.size() / h.size()),
     columns(h.size())
+{
+  data.swap(d);
+  arena.swap(a);
+  // The arena won't move again, so text cells can point into it.
+  const char * base = arena.empty() ? "" : &arena[0];
+  for (DataType::iterator i = data.begin(), e = data.end(); i != e; ++i) {
+    if (i -> type == Cell::TEXT) i -> text = base + i -> integer;
+  }
+}
+
+
+/**
+ * CURSOR CODE BELOW:
+ */
+
+
+/**
+ * Initialize a Cursor over the argument prepared statement, which it
+ * finalizes when it is deleted.
+ */
+Cursor::Cursor(sqlite3 * db, const string & query, sqlite3_stmt * ps,
+               const int limit)
+  : db(db), query(query), ps(ps), limit(limit), fetched(0)
 {
   // Nothing to do!
 }
 
 
+/**
+ * Finalizes the statement, releasing the last row read.
+ */
+Cursor::~Cursor() {
+  if (ps) sqlite3_finalize(ps);
+}
+
+
+/**
+ * Steps to the next row, returning false once there are no more rows (or
+ * the limit has been read).  Locking and unexpected errors abort the program
+ * with the DB error message.
+ */
+bool Cursor::next() {
+  if (!ps || (limit > 0 && fetched >= limit)) return false;
+  int result = sqlite3_step(ps);
+  switch (result) {
+    // TODO(cpa): add more cases to handle errors.
+    case SQLITE_ROW:
+      ++fetched;
+      return true;
+    case SQLITE_CONSTRAINT:
+      // Note: there is no point retrying this type of error.  Duplicates are
+      // expected, but a trigger only refuses a row that would be lost.
+      if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_TRIGGER) {
+        LOG(ERROR) << "Failed to execute '" << query << "': "
+                   << sqlite3_errmsg(db);
+      } else {
+        LOG(DEBUG) << "constraint violation executing: '" << query << "'";
+      }
+      break;
+    case SQLITE_DONE:
+      break;
+    case SQLITE_LOCKED:  // Fallthrough.
+    case SQLITE_BUSY:
+      // The busy handler has already waited out ASH_CFG_DB_BUSY_TIMEOUT.
+      LOG(FATAL) << "Failed to unlock db: " << sqlite3_errmsg(db)
+                 << "\nExecuting: '" << query << "'\n";
+      break;  // unreachable
+    default:
+      // TODO(cpa): remove this cerr line once the FATAL errors are redirected to stderr by default.
+      cerr << "unknown sqlite3_step code: " << result << " executing '"
+           << query << "'\nError:\n" << sqlite3_errmsg(db) << endl;
+      LOG(FATAL) << "unknown sqlite3_step code: " << result
+                 << " executing '" << query << "'\nError:\n"
+                 << sqlite3_errmsg(db);
+  }
+  sqlite3_finalize(ps);
+  ps = 0;
+  return false;
+}
+
+
+/**
+ * Reads the remaining rows, or no more than the argument number of them if it
+ * isn't zero, into a ResultSet, returning NULL if there are none.
+ */
+ResultSet * Cursor::rest(const size_t most) {
+  ResultSet::HeadersType headers;
+  ResultSet::DataType results;
+  ResultSet::ArenaType arena;
+  const size_t cols = columns();
+  while ((!most || results.size() < most * cols) && next()) {
+    // build the list of header names, if this is the first row fetched.
+    if (headers.empty()) {
+      for (size_t c = 0; c < cols; ++c) headers.push_back(name(c));
+    }
+    // Add the row data, copying the text, which sqlite releases at the next
+    // step.
+    for (size_t c = 0; c < cols; ++c) {
+      ResultSet::append(results, arena, cell(c));
+    }
+  }
+  return results.empty() ? 0 : new ResultSet(headers, results, arena);
+}
+
+
+/**
+ * Returns the number of columns in each row.
+ */
+size_t Cursor::columns() const {
+  return ps ? sqlite3_column_count(ps) : 0;
+}
+
+
+/**
+ * Returns the name of the argument column.
+ */
+const char * Cursor::name(const size_t column) const {
+  return sqlite3_column_name(ps, column);
+}
+
+
+/**
+ * Returns the value of the argument column of the current row.  Its text is
+ * only valid until the next step.
+ */
+const Cell Cursor::cell(const size_t column) const {
+  switch (sqlite3_column_type(ps, column)) {
+    case SQLITE_NULL:
+      return Cell();
+    case SQLITE_INTEGER:
+      return Cell((long int) sqlite3_column_int64(ps, column));
+    case SQLITE_FLOAT:
+      return Cell(sqlite3_column_double(ps, column));
+    default: {
+      const char * text = (const char *) sqlite3_column_text(ps, column);
+      return Cell(text ? text : "", sqlite3_column_bytes(ps, column));
+    }
+  }
+}
+
+
+/**
+ * DATABASE CODE BELOW:
+ */
+
+
 /**
  * Create a new Database, creating a new backing file if necessary.
  */
 Database::Database(const string & filename)
-  : db_filename(filename), db(0)
+  : db_filename(filename), db(0), inserts()
 {
   struct stat file;
   // Test that the history file exists, if not, create it.
@@ -83,6 +381,7 @@ Database::Database(const string & filename)
     FILE * created_file = fopen(db_filename.c_str(), "w+e");
     if (!created_file) {
       LOG(FATAL) << "failed to create new DB file: " << db_filename << endl;
+      return;
     }
     fclose(created_file);
   }
@@ -91,48 +390,302 @@ Database::Database(const string & filename)
   if (sqlite3_open(db_filename.c_str(), &db)) {
     LOG(FATAL) << "Failed to open " << db_filename << "\nError: "
         << sqlite3_errmsg(db) << endl;
+    sqlite3_close(db);
+    db = 0;
+    return;
+  }
+  configure();
+
+  // The schema version is in the file header, so this is cheap.
+  const int version = user_version();
+  if (version == DBObject::schema_version()) return;  // Normal case.
+  if (version > DBObject::schema_version()) {
+    LOG(WARNING) << db_filename << " has schema version " << version
+                 << ", newer than this program's version "
+                 << DBObject::schema_version();
+    return;
+  }
+  configure_file();
+
+  if (version == 0) {
+    // Databases created before the schema was versioned have tables already;
+    // those are stamped as version 1 and migrated forward.
+    ResultSet * rs = exec("SELECT 1 FROM sqlite_master WHERE type = 'table';");
+    const bool legacy = rs != 0;
+    if (rs) delete rs;
+    if (legacy) {
+      run_script("", 1);
+    } else {
+      init_db();
+    }
   }
+  migrate();
+}
 
-  // Init the DB if it is missing the main tables.
-  size_t registered = DBObject::table_names.size();
+
+/**
+ * Close the Database and free internal resources.
+ */
+Database::~Database() {
+  typedef map<string, sqlite3_stmt *>::iterator iter;
+  for (iter i = inserts.begin(), e = inserts.end(); i != e; ++i)
+    sqlite3_finalize(i -> second);
+  inserts.clear();
+  if (db) {
+    // Virtual tables (like FTS4) finalize their own statements as they are
+    // disconnected.  Anything still open after a FATAL error that was handled
+    // without exiting (see Logger::set_fatal_handler) defers the close until
+    // it is finalized, rather than failing it.
+    sqlite3_close_v2(db);
+    db = 0;
+  }
+}
+
+
+/**
+ * Returns the configured value if it is one of the allowed (upper case)
+ * choices, otherwise the default.
+ */
+const string get_choice(const string & key, const string & dv,
+                        const char * choices[])
+{
+  string value = Config::instance().get_string(key, dv);
+  for (string::iterator i = value.begin(), e = value.end(); i != e; ++i)
+    *i = toupper(*i);
+  for (size_t i = 0; choices[i]; ++i)
+    if (value == choices[i]) return value;
+  LOG(WARNING) << "Ignoring invalid ASH_CFG_" << key << ": '" << value << "'";
+  return dv;
+}
+
+
+/**
+ * The SQL function ash_hash(text), which returns the 64-bit FNV-1a hash of the
+ * UTF-8 bytes of its argument as a signed integer.  Command texts are keyed by
+ * it, so it must never change.  NULL hashes to NULL.
+ *
+ * ash_hash(text, n) is the n-th probe for a text whose hash is taken: the hash
+ * continued with 0x100 | n, which no byte of a text can match.
+ */
+void ash_hash(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+  const unsigned char * text = sqlite3_value_text(argv[0]);
+  const int size = sqlite3_value_bytes(argv[0]);
+
+  // The offset basis and prime are built up to avoid 'long long' literals.
+  sqlite3_uint64 hash = ((sqlite3_uint64) 0xcbf29ce4 << 32) | 0x84222325;
+  const sqlite3_uint64 prime = ((sqlite3_uint64) 0x100 << 32) | 0x1b3;
+  for (int i = 0; i < size; ++i) {
+    hash ^= text[i];
+    hash *= prime;
+  }
+  const int probe = argc > 1 ? sqlite3_value_int(argv[1]) : 0;
+  if (probe > 0) {
+    hash ^= 0x100 | (probe & 0xff);
+    hash *= prime;
+  }
+  sqlite3_result_int64(context, (sqlite3_int64) hash);
+}
+
+
+/**
+ * The SQL function ash_bm25(matchinfo(fts_table, 'pcnalx')), which returns the
+ * Okapi BM25 relevance of a full-text match: higher is better.  FTS4 has no
+ * ranking of its own, so this scores each phrase of the query by how often it
+ * appears in the row, how rare it is over all rows and how long the row is.
+ */
+void ash_bm25(sqlite3_context * context, int argc, sqlite3_value ** argv) {
+  const unsigned int * info =
+    (const unsigned int *) sqlite3_value_blob(argv[0]);
+  const int size = sqlite3_value_bytes(argv[0]) / sizeof(unsigned int);
+  if (!info || size < 3) {
+    sqlite3_result_error(context, "ash_bm25 expects matchinfo 'pcnalx'", -1);
+    return;
+  }
+  const unsigned int phrases = info[0], columns = info[1], rows = info[2];
+  if ((unsigned int) size != 3 + 2 * columns + 3 * phrases * columns) {
+    sqlite3_result_error(context, "ash_bm25 expects matchinfo 'pcnalx'", -1);
+    return;
+  }
+  const unsigned int * average_length = info + 3;
+  const unsigned int * length = average_length + columns;
+  const unsigned int * hits = length + columns;
+
+  const double k1 = 1.2, b = 0.75;
+  double score = 0.0;
+  for (unsigned int p = 0; p < phrases; ++p) {
+    for (unsigned int c = 0; c < columns; ++c) {
+      const unsigned int * x = hits + 3 * (c + p * columns);
+      const double frequency = x[0], documents = x[2];
+      if (frequency == 0) continue;
+      double idf = log((rows - documents + 0.5) / (documents + 0.5));
+      if (idf < 1e-6) idf = 1e-6;  // Common terms still count a little.
+      const double norm = average_length[c]
+        ? (double) length[c] / average_length[c] : 1.0;
+      score += idf * frequency * (k1 + 1)
+        / (frequency + k1 * (1 - b + b * norm));
+    }
+  }
+  sqlite3_result_double(context, score);
+}
+
+
+/**
+ * Applies the configured locking and journaling settings to the connection.
+ *
+ * Lock waits are handled by sqlite's busy handler for up to
+ * ASH_CFG_DB_BUSY_TIMEOUT ms.  In WAL mode (the default) readers and the
+ * writer never block each other, so ash_query can't stall a prompt.  Only
+ * the settings that differ from sqlite's defaults (as built) are sent, and
+ * those kept in the file itself are left to configure_file.
+ */
+void Database::configure() {
+  Config & config = Config::instance();
+
+  int timeout = config.get_int("DB_BUSY_TIMEOUT", -1);
+  sqlite3_busy_timeout(db, timeout < 0 ? 5000 : timeout);
+  sqlite3_create_function(db, "ash_hash", 1, SQLITE_UTF8, 0, ash_hash, 0, 0);
+  sqlite3_create_function(db, "ash_hash", 2, SQLITE_UTF8, 0, ash_hash, 0, 0);
+  sqlite3_create_function(db, "ash_bm25", 1, SQLITE_ANY, 0, ash_bm25, 0, 0);
+
+  static const char * levels[] = {"OFF", "NORMAL", "FULL", "0", "1", "2", 0};
+  const string level = get_choice("DB_SYNCHRONOUS", "NORMAL", levels);
+  const string mode = journal_mode();
+  const int limit = config.get_int("DB_JOURNAL_SIZE_LIMIT", 4 << 20);
+  const int pages = config.get_int("DB_WAL_AUTOCHECKPOINT", 1000);
 
   stringstream ss;
-  ss << "select count(*) as table_count "
-     << "from sqlite_master "
-     << "where type = 'table' and tbl_name in (";
+  if (level != "FULL" && level != "2") {
+    ss << "PRAGMA synchronous=" << level << "; ";
+  }
+  // Only WAL mode is stored in the file; the others last for the connection.
+  if (mode != "WAL" && mode != "DELETE") {
+    ss << "PRAGMA journal_mode=" << mode << "; ";
+  }
+  if (limit != DEFAULT_JOURNAL_SIZE_LIMIT) {
+    ss << "PRAGMA journal_size_limit=" << limit << "; ";
+  }
+  if (mode == "WAL" && pages != DEFAULT_WAL_AUTOCHECKPOINT) {
+    ss << "PRAGMA wal_autocheckpoint=" << pages << "; ";
+  }
+  if (ss.str().empty()) return;
+
+  char * error = 0;
+  if (sqlite3_exec(db, ss.str().c_str(), 0, 0, &error)) {
+    LOG(ERROR) << "Failed to configure " << db_filename << ": " << error;
+    sqlite3_free(error);
+  }
+}
 
-  // List the table names registered by the code.
-  if (registered > 0) ss << DBObject::quote(DBObject::table_names[0]);
-  for (size_t i = 1; i < registered; ++i)
-    ss << ", " << DBObject::quote(DBObject::table_names[i]);
 
-  ss << ");";
-  string query = ss.str();
+/**
+ * Applies the settings that are kept in the database file: WAL (or not) and
+ * incremental vacuuming.  These only need to be checked when the file is new
+ * or its schema is about to change, so an existing database only switches
+ * between WAL and DELETE with its next upgrade.
+ */
+void Database::configure_file() {
+  // New databases free pages as ash_archive asks, rather than all at once by
+  // VACUUM.  This has no effect once a database has tables.
+  char * error = 0;
+  if (sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL;", 0, 0, &error)) {
+    LOG(ERROR) << "Failed to configure " << db_filename << ": " << error;
+    sqlite3_free(error);
+  }
 
-  ResultSet * rs = exec(query.c_str());
-  size_t defined_tables =
-    rs && rs -> rows == 1 ? atoi(rs -> data[0][0].c_str()) : 0;
+  const string mode = journal_mode();
+  ResultSet * rs = exec("PRAGMA journal_mode;");
+  string current = rs && rs -> rows == 1 ? rs -> cell(0, 0).str() : "";
   if (rs) delete rs;
-  if (defined_tables == registered) return;  // Normal case.
+  for (string::iterator i = current.begin(), e = current.end(); i != e; ++i)
+    *i = toupper(*i);
+  if (current == mode) return;
 
-  // Initialize the DB if it's not already set up.
-  init_db();
+  rs = exec("PRAGMA journal_mode=" + mode + ";");
+  current = rs && rs -> rows == 1 ? rs -> cell(0, 0).str() : "";
+  if (rs) delete rs;
+  LOG(INFO) << "Changed the journal mode of " << db_filename << " to "
+            << current;
+}
+
+
+/**
+ * Returns the configured ASH_CFG_DB_JOURNAL_MODE.
+ */
+const string Database::journal_mode() const {
+  static const char * modes[] =
+    {"WAL", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "OFF", 0};
+  return get_choice("DB_JOURNAL_MODE", "WAL", modes);
+}
 
-  // Log a warning if there was an unexpected number of tables.
-  if (defined_tables > registered) {
-    LOG(WARNING) << "Expected " << registered
-        << " tables to be defined, found " << defined_tables << " instead.";
+
+/**
+ * Attaches another file of this history, such as an older shard, to this
+ * connection as the argument schema.  A file with an older schema is migrated
+ * first, if it can be written.  Files that still differ from this program's
+ * schema can't be queried alongside the others, so they are detached again.
+ * Returns true if the file was attached.
+ */
+bool Database::attach(const string & file, const string & schema) {
+  stringstream ss;
+  ss << "ATTACH DATABASE '";
+  for (string::const_iterator i = file.begin(), e = file.end(); i != e; ++i) {
+    if (*i == '\'') ss << '\'';
+    ss << *i;
   }
+  ss << "' AS " << schema << ";";
+  ResultSet * rs = exec(ss.str());
+  if (rs) delete rs;
+
+  const string version_sql = "PRAGMA " + schema + ".user_version;";
+  rs = exec(version_sql);
+  int version = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : 0;
+  if (rs) delete rs;
+  if (version < DBObject::schema_version() && !access(file.c_str(), W_OK)) {
+    { Database shard(file); }
+    rs = exec(version_sql);
+    version = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : 0;
+    if (rs) delete rs;
+  }
+  if (version == DBObject::schema_version()) return true;
+
+  LOG(WARNING) << "Skipping " << file << ": it has schema version " << version
+               << " rather than " << DBObject::schema_version();
+  rs = exec("DETACH DATABASE " + schema + ";");
+  if (rs) delete rs;
+  return false;
 }
 
 
 /**
- * Close the Database and free internal resources.
+ * Checkpoints the WAL once it has grown past ASH_CFG_DB_WAL_SIZE_LIMIT bytes.
+ *
+ * The automatic checkpoints run after commits are passive: they give up on
+ * pages that an open reader still needs, so a busy machine can grow the WAL
+ * without bound.  This waits (up to the busy timeout) for those readers and
+ * restarts the log, letting the next writer truncate it to
+ * ASH_CFG_DB_JOURNAL_SIZE_LIMIT.
  */
-Database::~Database() {
-  if (db) {
-    sqlite3_close(db);
-    db = 0;
+void Database::checkpoint() const {
+  if (!db) return;
+  struct stat wal;
+  const string wal_file = db_filename + "-wal";
+  if (stat(wal_file.c_str(), &wal)) return;  // Not in WAL mode.
+
+  int limit = Config::instance().get_int("DB_WAL_SIZE_LIMIT", 16 << 20);
+  if (wal.st_size <= limit) return;
+
+  int log = 0, done = 0;
+  int rval = sqlite3_wal_checkpoint_v2(db, 0, SQLITE_CHECKPOINT_RESTART,
+                                       &log, &done);
+  if (rval == SQLITE_OK) {
+    LOG(INFO) << "Checkpointed " << done << " of " << log << " WAL frames.";
+  } else {
+    LOG(WARNING) << "WAL checkpoint of " << db_filename << " (" << wal.st_size
+                 << " bytes) incomplete: " << sqlite3_errmsg(db);
   }
 }
 
@@ -147,272 +700,455 @@ int NOOPCallback(void * ignored, int rows, char ** cols, char ** col_names) {
 
 
 /**
- * Executes the create-tables query to initialize this database.
+ * Executes the create-tables query to initialize this database.  The tables
+ * are created in their latest form, so the current schema version is stamped.
  */
 void Database::init_db() {
   const string & create_tables = DBObject::get_create_tables();
+  stringstream ss;
+  ss << create_tables;
+  // The ids of a new shard start in its month's range.
+  const long int first_id = Shards::first_id(db_filename);
+  if (first_id) {
+    ss << "INSERT INTO sqlite_sequence (name, seq) "
+       << "SELECT name, " << first_id << " FROM sqlite_master "
+       << "WHERE type = 'table' AND sql LIKE '%autoincrement%'; ";
+  }
+  if (!run_script(ss.str(), DBObject::schema_version())) {
+    cerr << "Failed to create tables:\n" << create_tables << endl;
+  }
+}
+
+
+/**
+ * Whether this program runs migrations that can't be chunked.  Loggers run at
+ * the prompt and leave them to ashd and the other tools.
+ */
+bool Database::unchunked_migrations = false;
+
+
+/**
+ * Lets (or stops) the migrations of databases opened after this call include
+ * those that can't be chunked.
+ */
+void Database::run_unchunked_migrations(const bool run) {
+  unchunked_migrations = run;
+}
+
+
+/**
+ * Returns the schema version stamped in the database header.
+ */
+int Database::user_version() const {
+  ResultSet * rs = exec("PRAGMA user_version;");
+  int version = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : 0;
+  if (rs) delete rs;
+  return version;
+}
+
+
+/**
+ * Starts a write transaction.  Returns false, without aborting the program,
+ * if the lock isn't granted within ASH_CFG_DB_BUSY_TIMEOUT.
+ */
+bool Database::begin() const {
+  if (!db) return false;
   char * error = 0;
-  if (sqlite3_exec(db, create_tables.c_str(), NOOPCallback, 0, &error)) {
-    cerr << "Failed to create tables:\n"
-         << create_tables
-         << "Error:\n"
-         << error << endl;
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", 0, 0, &error)) {
+    LOG(ERROR) << "Failed to lock " << db_filename << ": " << error;
     sqlite3_free(error);
-    error = 0;
+    return false;
   }
+  return true;
 }
 
 
 /**
- * This method is only to be invoked if the database were locked when an insert
- * or other query was attempted.
+ * Commits the open transaction, or rolls it back and returns false if the
+ * commit fails.
+ */
+bool Database::commit() const {
+  if (!db) return false;
+  char * error = 0;
+  if (sqlite3_exec(db, "COMMIT;", 0, 0, &error)) {
+    LOG(ERROR) << "Failed to commit " << db_filename << ": " << error;
+    sqlite3_free(error);
+    rollback();
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Abandons the open transaction, if there is one.
+ */
+void Database::rollback() const {
+  if (db && !sqlite3_get_autocommit(db)) {
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+  }
+}
+
+
+/**
+ * Runs the argument SQL in a write transaction, optionally stamping a new
+ * schema version.  The version is only stamped if the database was at the
+ * previous version when the transaction began, so concurrent migrations can't
+ * apply the same change twice.  Returns false (and rolls back) on error.
+ */
+bool Database::run_script(const string & sql, const int version) {
+  if (!begin()) return false;
+
+  if (version && user_version() >= version) {
+    rollback();
+    return true;  // Another process got here first.
+  }
+
+  stringstream ss;
+  ss << sql << ";\n";
+  if (version) ss << "PRAGMA user_version = " << version << ";\n";
+  ss << "COMMIT;";
+  char * error = 0;
+  if (sqlite3_exec(db, ss.str().c_str(), NOOPCallback, 0, &error)) {
+    LOG(ERROR) << "Failed to run:\n" << sql << "\nError: " << error;
+    sqlite3_free(error);
+    rollback();
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Runs one chunk of a migration in its own transaction and returns the number
+ * of rows it changed, or -1 on error.
+ */
+long int Database::run_chunk(const Migration & migration, const int chunk) {
+  if (!begin()) return -1;
+
+  long int changed = 0;
+  if (migration.step) {
+    changed = migration.step(*this, chunk);
+  } else {
+    sqlite3_stmt * ps = prepare_stmt(migration.chunk);
+    int index = sqlite3_bind_parameter_index(ps, ":chunk");
+    if (index) sqlite3_bind_int(ps, index, chunk);
+    int result;
+    while ((result = sqlite3_step(ps)) == SQLITE_ROW) {}
+    sqlite3_finalize(ps);
+    changed = result == SQLITE_DONE ? sqlite3_changes(db) : -1;
+  }
+
+  if (changed < 0) {
+    LOG(ERROR) << "Migration " << migration.version << " (" << migration.name
+               << ") failed: " << sqlite3_errmsg(db);
+    rollback();
+    return -1;
+  }
+  return commit() ? changed : -1;
+}
+
+
+/**
+ * Applies pending migrations for up to ASH_CFG_DB_MIGRATION_BUDGET_MS ms and
+ * returns true once the schema is current.  Unfinished work resumes the next
+ * time a Database is opened (or, in ashd, the next time the daemon is idle).
  *
- * This method does a lot to make sure a good sleep is had.  It checks the
- * configured sleep settings: ASH_CFG_DB_FAIL_RANDOM_TIMEOUT and
- * ASH_CFG_DB_FAIL_TIMEOUT.  It also tries to make sure that the specified sleep
- * amount is honored.
+ * Only one process migrates at a time, holding a flock on <db>.migrate
+ * (removed again when it is done); the others skip this and keep using the
+ * schema as it is.  Unless run_unchunked_migrations was set, migration
+ * stops before one that can't be chunked, since no budget can cut it short.
  */
-void ash_sleep() {
-  Config & config = Config::instance();
+bool Database::migrate() {
+  int version = user_version();
+  if (version >= DBObject::schema_version()) return true;
+
+  const string lock_file = db_filename + ".migrate";
+  int lock = open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat held, named;
+  if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) || fstat(lock, &held)
+      || stat(lock_file.c_str(), &named) || held.st_ino != named.st_ino)
+  {
+    // A lock file that was removed after we opened it belongs to a migration
+    // that has just finished.
+    LOG(DEBUG) << "Skipped migrating " << db_filename << ": "
+               << (lock < 0 ? strerror(errno) : "already in progress");
+    if (lock >= 0) close(lock);
+    return false;
+  }
 
-  int retries = config.get_int("DB_MAX_RETRIES", -1);
-  if (retries < 0) retries = 5;
-
-  int fail_ms = config.get_int("DB_FAIL_TIMEOUT", -1);
-  if (fail_ms < 0) fail_ms = 0;
-
-  int random_ms = config.get_int("DB_FAIL_RANDOM_TIMEOUT", -1);
-  if (random_ms < 0) random_ms = 0;
-
-  // Sleep a number amount of ms within the parameters.
-  unsigned long int ms = fail_ms;
-  if (random_ms > 0) {
-    // Randomize with both the time and the PID.  Since the database being
-    // locked is likely a collission with another _ash_log - time along will
-    // randomize both processes to generate the same random numbers.
-    srand(time(0) ^ getpid());
-    ms += rand() % random_ms;
-  }
-  LOG(INFO) << "Sleeping " << ms << " milliseconds.";
-  if (ms == 0) return;
-
-  // Measure a timestamp to count how long we actually slept.
-  struct timespec before_ts, after_ts;
-  if (clock_gettime(CLOCK_MONOTONIC, &before_ts)) {
-    perror("clock_gettime failed");
-  }
-
-  unsigned int sleep_attempts = retries * 2;
-  struct timespec to_sleep, remaining;
-  to_sleep.tv_sec = ms / 1000L;
-  to_sleep.tv_nsec = (ms % 1000L) * 1000000L;
-
-  while (to_sleep.tv_sec || to_sleep.tv_nsec) {
-    // Sanity check to make sure we aren't looping infinitely.
-    if (sleep_attempts == 0) {
-      LOG(WARNING) << "Sleep break triggered.  CLOCK_MONOTONIC may not work as "
-                   << "expected on your system.  Or the database may be "
-                   << "extremely busy with concurrent requests.";
-      break;  // safety
+  Config & config = Config::instance();
+  int chunk = config.get_int("DB_MIGRATION_CHUNK", 5000);
+  if (chunk <= 0) chunk = 5000;
+  long int budget = config.get_int("DB_MIGRATION_BUDGET_MS", 200);
+  const long int deadline = Util::now_ms() + budget;
+
+  bool current = true;
+  typedef map<int, Migration>::const_iterator iter;
+  for (iter i = DBObject::migrations.upper_bound(version),
+       e = DBObject::migrations.end(); i != e; ++i)
+  {
+    const Migration & m = i -> second;
+    if (m.unchunked && !unchunked_migrations) {
+      LOG(DEBUG) << "Left migrating " << db_filename << " to version "
+                 << m.version << " (" << m.name << ") to ashd or ash_query";
+      current = false;
+      break;
     }
-    --sleep_attempts;
-
-    // Sleep and verify the return code.
-    int rval = clock_nanosleep(CLOCK_MONOTONIC, 0, &to_sleep, &remaining);
-    switch (rval) {
-      case -1: 
-        LOG(ERROR) << "Failed to clock_nanosleep: " << strerror(errno);
-        continue;
-      case 0: break;
-      case EFAULT:
-        LOG(ERROR) << "clock_nanosleep: EFAULT sleeping " << ms << " ms.";
-        break;
-      case EINTR:
-        LOG(ERROR) << "clock_nanosleep: EINTR sleeping " << ms << " ms.";
-        break;
-      case EINVAL:
-        LOG(ERROR) << "clock_nanosleep: EINVAL sleeping (tv_sec="
-                   << to_sleep.tv_sec << ", tv_nsec="
-                   << to_sleep.tv_nsec << ")";
-        break;
-      default:
-        LOG(ERROR) << "Unexpected rval from clock_nanosleep: " << rval;
+    LOG(INFO) << "Migrating " << db_filename << " to version " << m.version
+              << ": " << m.name;
+    if (!m.setup.empty() && !run_script(m.setup)) {
+      current = false;
+      break;
     }
 
-    // If there is any time remaining, prepare to sleep again.
-    if (remaining.tv_sec == 0
-        && remaining.tv_nsec > 0
-        && remaining.tv_nsec <= 999999999
-        && remaining.tv_nsec < to_sleep.tv_nsec)
-    {
-      LOG(DEBUG) << "slept (to_sleep.tv_nsec - remaining.tv_nsec = "
-                 << to_sleep.tv_nsec << " - " << remaining.tv_nsec << " = "
-                 << (to_sleep.tv_nsec - remaining.tv_nsec) << ")";
-      to_sleep.tv_sec = remaining.tv_sec;
-      to_sleep.tv_nsec = remaining.tv_nsec;
+    long int changed = 0;
+    if (m.step || !m.chunk.empty()) {
+      do {
+        changed = run_chunk(m, chunk);
+      } while (changed > 0 && (budget <= 0 || Util::now_ms() < deadline));
+    }
+    if (changed != 0 || !run_script(m.finish, m.version)) {
+      current = false;
+      break;
     }
   }
 
-  // Check to see how long has passed since ash_sleep began.
-  if (clock_gettime(CLOCK_MONOTONIC, &after_ts)) {
-    perror("clock_gettime failed");
-  }
-  
-  unsigned long int slept =
-    (after_ts.tv_sec - before_ts.tv_sec) * 1000 +
-    (after_ts.tv_nsec - before_ts.tv_nsec) / 1000000L;
+  unlink(lock_file.c_str());
+  close(lock);
+  return current;
+}
 
-  LOG(INFO) << "Slept " << slept << " milliseconds.";
 
-  if (ms > slept) {
-    // This should never happen because of the while loop above.
-    LOG(ERROR) << "Failed to sleep " << ms << " ms between failures.";
+/**
+ * Returns the cached INSERT statement for the table backing a DBObject,
+ * preparing it the first time the table is seen.  Parameters are named after
+ * the columns they bind, so a cached statement is only reused if it binds the
+ * same columns in the same order.
+ */
+sqlite3_stmt * Database::prepare_insert(const DBObject & object) const {
+  const string table = object.get_name();
+  const map<string, Value> & values = object.values;
+  typedef map<string, Value>::const_iterator c_iter;
+
+  map<string, sqlite3_stmt *>::iterator cached = inserts.find(table);
+  if (cached != inserts.end()) {
+    sqlite3_stmt * ps = cached -> second;
+    bool same = (size_t) sqlite3_bind_parameter_count(ps) == values.size();
+    int p = 1;
+    for (c_iter i = values.begin(), e = values.end(); same && i != e; ++i) {
+      // Parameter names include the leading ':'.
+      same = (i -> first) == sqlite3_bind_parameter_name(ps, p++) + 1;
+    }
+    if (same) return ps;
+    LOG(DEBUG) << "Columns changed, re-preparing the insert into " << table;
+    sqlite3_finalize(ps);
+    inserts.erase(cached);
   }
-  
-  if (slept > (ms + 1) * 100) {
-    LOG(ERROR) << "Major clock problem detected.  Requested sleep of: " << ms
-               << " ms took " << slept << " ms to complete.";
+
+  stringstream ss;
+  ss << "INSERT INTO " << table << " (";
+  for (c_iter i = values.begin(), e = values.end(); i != e; ++i)
+    ss << (i == values.begin() ? "" : ", ") << i -> first;
+  ss << ") VALUES (";
+  for (c_iter i = values.begin(), e = values.end(); i != e; ++i)
+    ss << (i == values.begin() ? ":" : ", :") << i -> first;
+  ss << ");";
+
+  sqlite3_stmt * ps = prepare_stmt(ss.str());
+  if (ps) inserts[table] = ps;
+  return ps;
+}
+
+
+/**
+ * Binds a value to the argument parameter of a prepared statement.  Text is
+ * bound without a copy, so it must outlive the statement's next step.
+ */
+void Database::bind(sqlite3_stmt * ps, const int p, const Value & value) {
+  switch (value.type) {
+    case Value::INTEGER:
+      sqlite3_bind_int64(ps, p, value.integer);
+      break;
+    case Value::TEXT:
+      sqlite3_bind_text(ps, p, value.text.data(), value.text.size(),
+                        SQLITE_STATIC);
+      break;
+    case Value::NONE:  // fallthrough
+    default:
+      sqlite3_bind_null(ps, p);
   }
 }
 
 
 /**
- * Inserts the DBObject, returning the new ROWID.
+ * Inserts the DBObject, returning the new ROWID.  The INSERT statement for
+ * each table is prepared once and reused with freshly bound values.
  */
 long int Database::insert(DBObject * object) const {
   if (!object) return 0;
-  exec(object -> get_sql());
-  return sqlite3_last_insert_rowid(db);
+
+  sqlite3_stmt * ps = prepare_insert(*object);
+  if (!ps) return 0;
+  int p = 1;
+  typedef map<string, Value>::const_iterator c_iter;
+  for (c_iter i = object -> values.begin(), e = object -> values.end();
+       i != e; ++i, ++p)
+  {
+    bind(ps, p, i -> second);
+  }
+
+  int result = sqlite3_step(ps);
+  sqlite3_reset(ps);
+  switch (result) {
+    case SQLITE_DONE:
+      break;
+    case SQLITE_CONSTRAINT:
+      // Note: there is no point retrying this type of error.  Duplicates are
+      // expected, but a trigger only refuses a row that would be lost.
+      if (sqlite3_extended_errcode(db) == SQLITE_CONSTRAINT_TRIGGER) {
+        LOG(ERROR) << "Failed to insert into " << object -> get_name()
+                   << ": " << sqlite3_errmsg(db);
+      } else {
+        LOG(DEBUG) << "constraint violation inserting into "
+                   << object -> get_name() << ": " << sqlite3_errmsg(db);
+      }
+      break;
+    case SQLITE_LOCKED:  // fallthrough
+    case SQLITE_BUSY:
+      // The busy handler has already waited out ASH_CFG_DB_BUSY_TIMEOUT.
+      LOG(FATAL) << "Failed to unlock db: " << sqlite3_errmsg(db);
+      break;
+    default:
+      LOG(FATAL) << "unknown sqlite3_step code: " << result
+                 << " inserting into " << object -> get_name()
+                 << "\nError:\n" << sqlite3_errmsg(db);
+  }
+
+  // Release the bound text, which belongs to the object.
+  sqlite3_clear_bindings(ps);
+  return result == SQLITE_DONE ? sqlite3_last_insert_rowid(db) : 0;
+}
+
+
+/**
+ * Inserts a session unless one with the same start time, pid and host is in
+ * the database already, returning the id of the row either way.  A daemon
+ * may have written the session without its reply reaching the shell, which
+ * then writes the session itself: whichever of them is second finds the row
+ * the other wrote, since each looks and inserts in one write transaction.
+ */
+long int Database::insert_session(DBObject * session) const {
+  if (!session || !db) return 0;
+
+  char * error = 0;
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", 0, 0, &error)) {
+    LOG(FATAL) << "Failed to lock " << db_filename << ": " << error;
+    sqlite3_free(error);
+    return 0;
+  }
+  sqlite3_stmt * ps = prepare_stmt(
+    "SELECT id FROM sessions\n"
+    "WHERE start_time = ?1 AND pid = ?2 AND hostname IS ?3\n"
+    "ORDER BY id DESC LIMIT 1;");
+  const char * keys[] = { "start_time", "pid", "hostname" };
+  const map<string, Value> & values = session -> values;
+  for (int p = 0; p < 3; ++p) {
+    const map<string, Value>::const_iterator i = values.find(keys[p]);
+    bind(ps, p + 1, i == values.end() ? Value() : i -> second);
+  }
+  long int id = 0;
+  if (sqlite3_step(ps) == SQLITE_ROW) id = sqlite3_column_int64(ps, 0);
+  sqlite3_finalize(ps);
+
+  if (id) {
+    LOG(INFO) << "Session " << id << " was already written.";
+  } else {
+    id = insert(session);
+  }
+  ResultSet * rs = exec(id ? "COMMIT;" : "ROLLBACK;");
+  if (rs) delete rs;
+  return id;
 }
 
 
 /**
- * Returns a prepared statement if possible.  This method will attempt to
- * retry preparing the statement up to ASH_CFG_DB_MAX_RETRIES times before
- * admitting defeat and exiting the program with a FATAL error.
+ * Returns a prepared statement or exits the program with a FATAL error (or
+ * returns NULL, if the error was handled).  Lock waits are handled by the
+ * busy handler installed in configure.
  */
 sqlite3_stmt * Database::prepare_stmt(const string & query) const {
+  if (!db) return 0;  // Failed to open, and already logged.
   sqlite3_stmt * ps = 0;
+  int error_code = sqlite3_prepare_v2(db, query.c_str(), query.length(), &ps,
+                                      0);
+  if (ps) return ps;
+  LOG(FATAL) << "Unexpected error code while preparing statement: "
+             << error_code << "\nError: " << sqlite3_errmsg(db)
+             << "\nPreparing: '" << query << "'";
+  return 0;
+}
 
-  Config & config = Config::instance();
-  int max_retries = config.get_int("DB_MAX_RETRIES", -1);
-  if (max_retries <= 0) max_retries = 5;
-  int tries = max_retries + 1;
 
-try_prepare:
-  sqlite3_prepare_v2(db, query.c_str(), query.length(), &ps, 0);
-  if (ps) return ps;
-  int error_code = sqlite3_errcode(db);
-  switch (error_code) {
-    case SQLITE_LOCKED:  // fallthrough
-    case SQLITE_BUSY:
-      LOG(DEBUG) << "Database is busy while preparing a statement.";
-      sqlite3_finalize(ps);
-      if (--tries > 0) {
-        LOG(DEBUG) << "Sleeping and trying to prepare statement again.";
-        ash_sleep();
-        goto try_prepare;
-      }
-      LOG(FATAL) << "Failed to prepare statement after " << max_retries
-                 << " failed attempts.";
-      return 0;  // unreachable
-    default:
-      LOG(FATAL) << "Unexpected error code while preparing statement: "
-                 << error_code;
-      return 0;  // unreachable
-  }
+/**
+ * Returns a cursor over the rows of a query, aborting the program if it
+ * can't be prepared.  At most limit rows are read, unless limit is 0 (or
+ * less).  The caller deletes the cursor.
+ */
+Cursor * Database::cursor(const string & query, const int limit) const {
+  return new Cursor(db, query, prepare_stmt(query), limit);
 }
 
 
 /**
- * Execute a query or abort the program with the DB error message.
+ * Execute a query or abort the program with the DB error message.  Returns
+ * all the rows selected, or NULL if there are none.
  */
 ResultSet * Database::exec(const string & query, const int limit) const {
-  // Load the relevant configured values.
-  Config & config = Config::instance();
+  Cursor rows(db, query, prepare_stmt(query), limit);
+  return rows.rest();
+}
 
-  int max_retries = config.get_int("DB_MAX_RETRIES", -1);
-  if (max_retries <= 0) max_retries = 5;
-  int tries = max_retries + 1, fetched = 0;
 
-  ResultSet::HeadersType headers;
-  ResultSet::DataType results;
-  stringstream ss;
-  sqlite3_stmt * ps = prepare_stmt(query);
-  unsigned int rows, columns = sqlite3_column_count(ps);
-
-  // YES, this is a GOTO target.  This is used to implement the retry logic.
-  // If a query fails because of a lock, it may goto this block to retry.
-try_sql:
-  fetched = 0;
-  for (rows = 0; fetched < limit || limit <= 0; ++rows) {
-    int result = sqlite3_step(ps);
-    switch (result) {
-      // TODO(cpa): add more cases to handle errors.
-      case SQLITE_ROW:
-        // build the list of header names, if this is the first row fetched.
-        if (headers.empty()) {
-          for (size_t c = 0; c < columns; ++c) {
-            ss.str("");
-            ss << sqlite3_column_name(ps, c);
-            headers.push_back(ss.str());
-          }
-        }
-        // Add the row data.
-        results.push_back(ResultSet::RowType());
-        for (size_t c = 0; c < columns; ++c) {
-          ss.str("");
-          if (sqlite3_column_text(ps, c)) {
-            ss << sqlite3_column_text(ps, c);
-          }
-          results.back().push_back(ss.str());
-        }
-        ++fetched;
-        continue;  // for loop
-      case SQLITE_CONSTRAINT:
-        // Note: there is no point retrying this type of error.
-        LOG(DEBUG) << "constraint violation executing: '" << query << "'";
-        goto finalize;
-      case SQLITE_DONE:
-        goto finalize;
-      case SQLITE_LOCKED:  // Fallthrough.
-      case SQLITE_BUSY: {
-        // Abort if we are out of attempts.
-        if (tries <= 0) {
-          LOG(FATAL) << "Failed to unlock db: " << sqlite3_errmsg(db)
-                     << "\nGave up after " << max_retries << " failures."
-                     << "\nExecuting: '" << query << "'\n";
-        }
-
-        // Sleep some random number of milliseconds.
-        ash_sleep();
-
-        // Reset the prepared statement.
-        sqlite3_finalize(ps);
-        ps = prepare_stmt(query);
-
-        // Decrement the try count and jump.
-        --tries;
-        LOG(WARNING) << "Database was locked, tries remaining: " << tries;
-        goto try_sql;
-      }
-      default:
-        sqlite3_finalize(ps);
-        // TODO(cpa): remove this cerr line once the FATAL errors are redirected to stderr by default.
-        cerr << "unknown sqlite3_step code: " << result << " executing '"
-             << query << "'\nError:\n" << sqlite3_errmsg(db) << endl;
-        LOG(FATAL) << "unknown sqlite3_step code: " << result
-                   << " executing '" << query << "'\nError:\n"
-                   << sqlite3_errmsg(db);
-    }  // switch
-  }  // for loop
+/**
+ * Returns the name of the file backing this database.
+ */
+const string & Database::filename() const {
+  return db_filename;
+}
 
-  // Yes, another GOTO target.  This is used because there is a switch statement
-  // within a for loop and it's convenient to break the loop within the switch.
-finalize:
-  sqlite3_finalize(ps);
 
-  return rows ? new ResultSet(headers, results) : 0;
+/**
+ * Replaces each registered table and view, for this connection only, with a
+ * TEMP view of its rows in all the argument schemas (the main database,
+ * attached shards and restored archives) that have it.  Ids are unique
+ * across shards, so rows are concatenated, except those of distinct tables,
+ * which may be repeated in several shards.
+ */
+void Database::unite(const vector<string> & schemas) {
+  typedef vector<string>::const_iterator iter;
+  for (iter n = DBObject::table_names.begin(), e = DBObject::table_names.end();
+       n != e; ++n)
+  {
+    const string glue = DBObject::distinct_names.count(*n)
+      ? "\nUNION\n" : "\nUNION ALL\n";
+    stringstream ss;
+    ss << "CREATE TEMP VIEW " << *n << " AS\n";
+    bool empty = true;
+    for (iter s = schemas.begin(), f = schemas.end(); s != f; ++s) {
+      ResultSet * rs = exec("SELECT 1 FROM " + *s + ".sqlite_master "
+                            "WHERE name = '" + *n + "';");
+      if (!rs) continue;
+      delete rs;
+      if (!empty) ss << glue;
+      ss << "SELECT * FROM " << *s << "." << *n;
+      empty = false;
+    }
+    if (empty) ss << "SELECT * FROM main." << *n << " WHERE 0";
+    ss << ";";
+    ResultSet * rs = exec(ss.str());
+    if (rs) delete rs;
+  }
 }
 
 
@@ -426,58 +1162,55 @@ finalize:
  */
 const string DBObject::get_create_tables() {
   stringstream ss;
-  ss << "PRAGMA foreign_keys=OFF;"
-     << "BEGIN TRANSACTION;";
   typedef list<string>::iterator it;
   for (it i = create_tables.begin(), e = create_tables.end(); i != e; ++i) {
     ss << *i << "; ";
   }
-  ss << "COMMIT;";
   return ss.str();
 }
 
 
 /**
- * Adds a create-table query to the list of create-table queries.
+ * Returns the schema version of the tables created by get_create_tables.
+ * Version 1 is the schema that predates versioning.
  */
-void DBObject::register_table(const string & name, const string & sql) {
-  table_names.push_back(name);
-  create_tables.push_back(sql);
+int DBObject::schema_version() {
+  return migrations.empty() ? 1 : migrations.rbegin() -> first;
 }
 
 
 /**
- * Returns a quoted string value using a char * input.
+ * Adds a schema migration.  A migration is only needed to bring databases
+ * created by earlier versions up to date; the registered create-table queries
+ * must already produce the migrated schema.
  */
-const string DBObject::quote(const char * value) {
-  return value ? quote(string(value)) : "null";
+void DBObject::register_migration(const Migration & migration) {
+  if (migration.version <= 1 || migrations.count(migration.version)) {
+    LOG(FATAL) << "Invalid or duplicate schema migration: "
+               << migration.version << " (" << migration.name << ")";
+    return;
+  }
+  migrations.insert(make_pair(migration.version, migration));
 }
 
 
 /**
- * Returns a quoted string suitable for insertion into the DB.
- * Converts an empty string to null.  Removes unprintable characters.
- * Replaces all single-quotes with double single quotes in the output string.
+ * Adds the name of a table or view that is not created by its own query to
+ * the registered names.  Rows of a distinct table are shared between shards,
+ * so their union drops duplicates.
  */
-const string DBObject::quote(const string & in) {
-  if (in.empty()) return "null";
-  string out = "'";
-  char c;
-  for (string::const_iterator i = in.begin(), e = in.end(); i != e; ++i) {
-    c = *i;
-    switch (c) {
-      case '\n':  // fallthrough
-      case '\t':
-        out.push_back(c);
-        break;
-      case '\'':
-        out.push_back(c); // fallthrough
-      default:
-        if (isprint(c)) out.push_back(c);
-    }
-  }
-  out.push_back('\'');
-  return out;
+void DBObject::register_name(const string & name, const bool distinct) {
+  table_names.push_back(name);
+  if (distinct) distinct_names.insert(name);
+}
+
+
+/**
+ * Adds a create-table query to the list of create-table queries.
+ */
+void DBObject::register_table(const string & name, const string & sql) {
+  table_names.push_back(name);
+  create_tables.push_back(sql);
 }
 
 
@@ -498,32 +1231,16 @@ DBObject::~DBObject() {
 
 
 /**
- * Returns the SQL statement needed to insert a concrete instance of this
- * class.
+ * Sets a column to an integer value.
  */
-const string DBObject::get_sql() const {
-  typedef map<string, string>::const_iterator c_iter;
-
-  stringstream ss;
-  ss << "INSERT INTO " << get_name() << " (";
-
-  // Insert the column names.
-  for (c_iter i = values.begin(), e = values.end(); i != e; ) {
-    ss << (i -> first);
-    if (++i == e) break;
-    ss << ", ";
-  }
-
-  ss << ") VALUES (";
-  // Insert the values.
-  for (c_iter i = values.begin(), e = values.end(); i != e; ) {
-    ss << (i -> second);
-    if (++i == e) break;
-    ss << ", ";
-  }
+void DBObject::set(const string & column, const long int value) {
+  values[column] = Value(value);
+}
 
-  ss << "); ";
 
-  return ss.str();
+/**
+ * Sets a column to a text value.  Empty strings are stored as null.
+ */
+void DBObject::set(const string & column, const string & value) {
+  values[column] = Value(value);
 }
-
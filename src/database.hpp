@@ -18,8 +18,10 @@
 #define __ASH_DATABASE__
 
 
+#include <iosfwd>
 #include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -35,33 +37,124 @@ namespace ash {
 
 class Database;  // Forward declaration.
 class DBObject;  // Forward declaration.
+struct Migration;  // Forward declaration.
+struct Value;  // Forward declaration.
 
 
 /**
- * This is the result of a query that selects multiple rows.
+ * One value selected by a query, kept in its sqlite storage class: NULL, an
+ * integer, a real or text.  Blobs are kept as text.  Text is a view of bytes
+ * owned by the ResultSet or Cursor the cell came from, and numbers are only
+ * turned into text when they are printed.
+ */
+struct Cell {
+  public:
+    enum Type { NONE, INTEGER, REAL, TEXT };
+
+  public:
+    Cell() : type(NONE), size(0) { integer = 0; }
+    explicit Cell(const long int i) : type(INTEGER), size(0) { integer = i; }
+    explicit Cell(const double r) : type(REAL), size(0) { real = r; }
+    Cell(const char * t, const size_t n) : type(TEXT), size(n) { text = t; }
+
+    const char * to_text(char * buffer, size_t & length) const;
+    const string str() const;
+    size_t width() const;
+    bool operator == (const Cell & other) const;
+    bool operator != (const Cell & other) const { return !(*this == other); }
+
+  public:
+    Type type;
+    unsigned int size;  // of the text, in bytes.
+    union {
+      long int integer;
+      double real;
+      const char * text;
+    };
+};
+
+std::ostream & operator << (std::ostream & out, const Cell & cell);
+
+
+/**
+ * This is the result of a query that selects multiple rows.  The cells are
+ * kept in one array, row after row, and the bytes of their text in one
+ * arena, so a result takes a few allocations however many rows it has.
  */
 class ResultSet {
   public:
     typedef list<string> HeadersType;
-    typedef vector<string> RowType;
-    typedef vector<RowType> DataType;
+    typedef vector<Cell> DataType;
+    typedef vector<char> ArenaType;
 
   public:
     ~ResultSet() {}
 
+    /**
+     * Returns the value in the argument row and column.
+     */
+    const Cell & cell(const size_t row, const size_t column) const {
+      return data[row * columns + column];
+    }
+
   private:
-    ResultSet(const HeadersType & headers, const DataType & data);
+    static void append(DataType & data, ArenaType & arena, const Cell & cell);
+
+  private:
+    ResultSet(const HeadersType & headers, DataType & data, ArenaType & arena);
 
   public:
     const HeadersType headers;
-    const DataType data;
     const size_t rows, columns;
 
+  private:
+    DataType data;
+    ArenaType arena;  // The bytes of the text cells.
+
   // DISALLOWED:
   private:
     ResultSet(const ResultSet & other);  // disallowed.
     ResultSet & operator = (const ResultSet & other);  // disallowed.
 
+  friend class Cursor;
+  friend class Database;
+  friend class Snapshot;
+};
+
+
+/**
+ * The rows of a query, read one at a time straight from sqlite.  Each call to
+ * next steps to the following row, whose values are only valid until the
+ * next call, so no more than one row is held in memory however many rows the
+ * query selects.
+ */
+class Cursor {
+  public:
+    ~Cursor();
+
+    bool next();
+    ResultSet * rest(const size_t most=0);
+
+    size_t columns() const;
+    const char * name(const size_t column) const;
+    const Cell cell(const size_t column) const;
+
+  private:
+    Cursor(sqlite3 * db, const string & query, sqlite3_stmt * ps,
+           const int limit);
+
+  private:
+    sqlite3 * db;
+    const string query;
+    sqlite3_stmt * ps;
+    const int limit;
+    int fetched;
+
+  // DISALLOWED:
+  private:
+    Cursor(const Cursor & other);  // disallowed.
+    Cursor & operator = (const Cursor & other);  // disallowed.
+
   friend class Database;
 };
 
@@ -70,22 +163,117 @@ class ResultSet {
  * This class abstracts a backing sqlite3 database.
  */
 class Database {
+  // STATIC:
+  public:
+    static void run_unchunked_migrations(const bool run);
+
+  private:
+    static bool unchunked_migrations;
+
+  // NON-STATIC:
   public:
     Database(const string & filename);
     virtual ~Database();
 
+    bool attach(const string & file, const string & schema);
+    bool begin() const;
+    void checkpoint() const;
+    bool commit() const;
+    Cursor * cursor(const string & query, const int limit=0) const;
     ResultSet * exec(const string & query, const int limit=0) const;
+    const string & filename() const;
 
     long int insert(DBObject * object) const;
+    long int insert_session(DBObject * session) const;
+    void rollback() const;
 
     void init_db();
+    bool migrate();
+    void unite(const vector<string> & schemas);
+
+  private:
+    void configure();
+    void configure_file();
+    const string journal_mode() const;
+    long int run_chunk(const Migration & migration, const int chunk);
+    bool run_script(const string & sql, const int version=0);
+    int user_version() const;
+
+  private:
+    static void bind(sqlite3_stmt * ps, const int p, const Value & value);
 
   private:
+    sqlite3_stmt * prepare_insert(const DBObject & object) const;
     sqlite3_stmt * prepare_stmt(const string & query) const;
 
   private:
     const string db_filename;
     sqlite3 * db;
+    // Prepared INSERT statements, keyed by table name.
+    mutable map<string, sqlite3_stmt *> inserts;
+
+  // DISALLOWED:
+  private:
+    Database(const Database & other);  // disallowed.
+    Database & operator = (const Database & other);  // disallowed.
+
+  friend class Archive;
+  friend class Merge;
+  friend class Snapshot;
+};
+
+
+/**
+ * A change to the schema of an existing database, identified by the
+ * user_version it leaves behind.  Migrations are applied in version order:
+ * setup runs first, then the chunk (a statement that may bind :chunk as a row
+ * limit) or step callback repeats until it changes no rows, then finish runs
+ * and the version is stamped.  Each of these runs in its own transaction, so
+ * live loggers only wait for one chunk at a time.
+ *
+ * A migration may be interrupted between chunks and resumed by another
+ * process, so setup must be idempotent and each chunk must make progress.
+ * One whose work can't be chunked holds the lock for as long as it takes on
+ * the whole history, so it is marked unchunked and only run by the programs
+ * that opt in (see Database::run_unchunked_migrations).
+ */
+struct Migration {
+  public:
+    typedef long int (*Step)(Database & db, const int chunk);
+
+  public:
+    Migration(const int version, const string & name, const string & setup,
+              const string & chunk, const string & finish, Step step=0,
+              const bool unchunked=false)
+      : version(version), name(name), setup(setup), chunk(chunk),
+        finish(finish), step(step), unchunked(unchunked) {}
+
+  public:
+    int version;
+    string name, setup, chunk, finish;
+    Step step;
+    bool unchunked;
+};
+
+
+/**
+ * A single column value of a DBObject: NULL, an integer or text.  Empty text
+ * is stored as NULL.
+ */
+struct Value {
+  public:
+    enum Type { NONE, INTEGER, TEXT };
+
+  public:
+    Value() : type(NONE), integer(0), text() {}
+    Value(const long int i) : type(INTEGER), integer(i), text() {}
+    Value(const string & t) : type(t.empty() ? NONE : TEXT), integer(0),
+      text(t) {}
+
+  public:
+    Type type;
+    long int integer;
+    string text;
 };
 
 
@@ -93,15 +281,18 @@ class Database {
 class DBObject {
   // STATIC:
   public:
-    static const string quote(const char * value);
-    static const string quote(const string & value);
     static const string get_create_tables();
+    static int schema_version();
 
   protected:
+    static void register_migration(const Migration & migration);
+    static void register_name(const string & name, const bool distinct=false);
     static void register_table(const string & name, const string & sql);
 
   protected:
     static list<string> create_tables;
+    static std::set<string> distinct_names;
+    static map<int, Migration> migrations;
     static vector<string> table_names;
 
   // NON-STATIC:
@@ -110,15 +301,18 @@ class DBObject {
     virtual ~DBObject();
 
     virtual const string get_name() const = 0;  // abstract
-    virtual const string get_sql() const;
 
-    map<string, string> values;
+    void set(const string & column, const long int value);
+    void set(const string & column, const string & value);
+
+    map<string, Value> values;
 
   // DISALLOWED:
   private:
     DBObject(const DBObject & other);  // disabled
     DBObject & operator =(const DBObject & other);  // disabled
 
+  friend class Daemon;
   friend class Database;
 };
 
@@ -16,12 +16,16 @@
 
 #include "formatter.hpp"
 
+#include <float.h>  /* for DBL_MAX */
+
 #include <algorithm>
 #include <iomanip>
+#include <sstream>
 #include <vector>
 
 #include "database.hpp"
 #include "logger.hpp"
+#include "util.hpp"
 
 
 using namespace ash;
@@ -62,7 +66,8 @@ map<string, string> Formatter::get_desc() {
  * Creates a Formatter, making sure it has a unique name among all Formatters.
  */
 Formatter::Formatter(const string & n, const string & d)
-  : name(n), description(d), do_show_headings(true)
+  : name(n), description(d), do_clip(false), do_show_headings(true),
+    window_rows(0)
 {
   if (lookup(name)) {
     LOG(FATAL) << "Conflicting formatters declared: " << name;
@@ -79,6 +84,15 @@ Formatter::~Formatter() {
 }
 
 
+/**
+ * Sets whether text wider than its column, in rows read after the widths are
+ * decided, is clipped to fit rather than widening the column.
+ */
+void Formatter::clip(bool clip) {
+  do_clip = clip;
+}
+
+
 /**
  * Sets the internal state controlling whether headings are shown or not.
  */
@@ -87,6 +101,27 @@ void Formatter::show_headings(bool show) {
 }
 
 
+/**
+ * Sets the number of rows a streaming formatter may read before it prints
+ * them, if it needs to see more than one row at a time.  With zero (the
+ * default), every row is read first.
+ */
+void Formatter::window(size_t rows) {
+  window_rows = rows;
+}
+
+
+/**
+ * Inserts the rows of a Cursor into an ostream.  Unless the formatter streams
+ * them, the rows are all read first.
+ */
+void Formatter::stream(Cursor & cursor, ostream & out) const {
+  ResultSet * rs = cursor.rest();
+  insert(rs, out);
+  if (rs) delete rs;
+}
+
+
 /**
  * Makes this Formatter avaiable for use within the program.
  */
@@ -97,9 +132,14 @@ void SpacedFormatter::init() {
 
 
 /**
- * Returns the maximum widths required for each column in a result set.
+ * Returns the maximum widths required for each column in a result set.  If
+ * runs is given, it is also filled with the number of times the value in each
+ * column changes from one row to the next, counting the first row's unless it
+ * is empty.
  */
-vector<size_t> get_widths(const ResultSet * rs, bool do_show_headings) {
+vector<size_t> get_widths(const ResultSet * rs, bool do_show_headings,
+                          vector<size_t> * runs=0)
+{
   vector<size_t> widths;
   const size_t XX = 4;  // The number of spaces between columns.
 
@@ -115,10 +155,15 @@ vector<size_t> get_widths(const ResultSet * rs, bool do_show_headings) {
   // Limit the width of columns containing very wide elements.
   size_t max_w = 80;  // TODO(cpa): make this a flag or configurable.
 
-  // Loop ofer the rs.data looking for max column widths.
+  // Loop ofer the rs.data looking for max column widths, and comparing each
+  // value with the one above it while it is at hand.
+  if (runs) runs -> assign(rs -> columns, 0);
+  const Cell none;
   for (size_t r = 0; r < rs -> rows; ++r) {
     for (size_t c = 0; c < rs -> columns; ++c) {
-      widths[c] = max(widths[c], min(max_w, XX + (rs -> data[r][c]).size()));
+      const Cell & value = rs -> cell(r, c);
+      widths[c] = max(widths[c], min(max_w, XX + value.width()));
+      if (runs && value != (r ? rs -> cell(r - 1, c) : none)) ++(*runs)[c];
     }
   }
 
@@ -127,14 +172,12 @@ vector<size_t> get_widths(const ResultSet * rs, bool do_show_headings) {
 
 
 /**
- * Calculates the ideal width for each column and inserts column data
- * left-aligned and separated by spaces.
+ * Inserts the headings, if they are shown, and rows of a ResultSet left-aligned
+ * in columns of the argument widths.
  */
-void SpacedFormatter::insert(const ResultSet * rs, ostream & out) const {
-  if (!rs) return;  // Sanity check.
-
-  vector<size_t> widths = get_widths(rs, do_show_headings);
-
+void insert_spaced(const ResultSet * rs, ostream & out,
+                   const vector<size_t> & widths, const bool do_show_headings)
+{
   // Print the headings, if not suppressed.
   if (do_show_headings) {
     size_t c = 0, cols = widths.size();
@@ -143,17 +186,83 @@ void SpacedFormatter::insert(const ResultSet * rs, ostream & out) const {
       if (c < cols - 1) out << left << setw(widths[c++]);
       out << *i;
     }
-    out << endl;
+    out << '\n';
   }
 
   // Iterate over the data once more, printing.
   for (size_t r = 0; r < rs -> rows; ++r) {
     for (size_t c = 0; c < rs -> columns; ++c) {
       if (c < rs -> columns - 1) out << left << setw(widths[c]);
-      out << (rs -> data)[r][c];
+      out << rs -> cell(r, c);
     }
-    out << endl;
+    out << '\n';
+  }
+}
+
+
+/**
+ * Calculates the ideal width for each column and inserts column data
+ * left-aligned and separated by spaces.
+ */
+void SpacedFormatter::insert(const ResultSet * rs, ostream & out) const {
+  if (!rs) return;  // Sanity check.
+
+  vector<size_t> widths = get_widths(rs, do_show_headings);
+  insert_spaced(rs, out, widths, do_show_headings);
+  out.flush();
+}
+
+
+/**
+ * Returns the argument text cell cut to no more than length bytes, and not in
+ * the middle of a UTF-8 character.
+ */
+const Cell clip_text(const Cell & cell, size_t length) {
+  if (cell.type != Cell::TEXT || cell.size <= length) return cell;
+  while (length > 0 && (cell.text[length] & 0xC0) == 0x80) --length;
+  return Cell(cell.text, length);
+}
+
+
+/**
+ * Streams data left-aligned and separated by spaces.  The widths are those of
+ * the first window of rows, which is printed at once.  The rows after it are
+ * printed as they are read: a wider value widens its column from then on, up
+ * to the usual limit, or if clipping, text is cut to fit its column.
+ */
+void SpacedFormatter::stream(Cursor & cursor, ostream & out) const {
+  if (!window_rows) {
+    Formatter::stream(cursor, out);
+    return;
+  }
+
+  ResultSet * rs = cursor.rest(window_rows);
+  if (!rs) return;
+
+  vector<size_t> widths = get_widths(rs, do_show_headings);
+  insert_spaced(rs, out, widths, do_show_headings);
+  delete rs;
+  out.flush();
+
+  const size_t XX = 4, max_w = 80, cols = widths.size();
+  for (size_t n = 1; cursor.next(); ++n) {
+    for (size_t c = 0; c < cols; ++c) {
+      Cell value = cursor.cell(c);
+      if (c < cols - 1) {
+        if (do_clip) {
+          value = clip_text(value, widths[c] - XX);
+        } else {
+          widths[c] = max(widths[c], min(max_w, XX + value.width()));
+        }
+        out << left << setw(widths[c]);
+      }
+      out << value;
+    }
+    out << '\n';
+    // Flush a window's worth of rows at a time.
+    if (n % window_rows == 0) out.flush();
   }
+  out.flush();
 }
 
 
@@ -179,13 +288,39 @@ void insert_delimited(const ResultSet * rs, ostream & out, const string & d,
   // Loop ofer the rs.data inserting delimited text.
   for (size_t r = 0; r < rs -> rows; ++r) {
     for (size_t c = 0; c < rs -> columns; ++c) {
-      out << rs -> data[r][c] << (c + 1 < rs -> columns ? d : "");
+      out << rs -> cell(r, c) << (c + 1 < rs -> columns ? d : "");
     }
     out << endl;
   }
 }
 
 
+/**
+ * Inserts the rows of a Cursor, as they are read, with all values delimited
+ * by a common delimiter.  Nothing is printed if there are no rows.
+ */
+void stream_delimited(Cursor & cursor, ostream & out, const string & d,
+                      const bool do_show_headings)
+{
+  const size_t columns = cursor.columns();
+  for (bool first = true; cursor.next(); first = false) {
+    if (first && do_show_headings) {
+      for (size_t c = 0; c < columns; ++c) {
+        // Don't add a delimiter after the last column.
+        out << cursor.name(c) << (c + 1 < columns ? d : "");
+      }
+      out << '\n';
+    }
+    for (size_t c = 0; c < columns; ++c) {
+      out << cursor.cell(c);
+      if (c + 1 < columns) out << d;
+    }
+    out << '\n';
+  }
+  out.flush();
+}
+
+
 /**
  * Makes this Formatter avaiable for use within the program.
  */
@@ -203,6 +338,247 @@ void CsvFormatter::insert(const ResultSet * rs, ostream & out) const {
 }
 
 
+/**
+ * Streams data separated by commas.
+ */
+void CsvFormatter::stream(Cursor & cursor, ostream & out) const {
+  stream_delimited(cursor, out, ",", do_show_headings);
+}
+
+
+/**
+ * For each byte of JSON text: the character that follows a backslash to escape
+ * it, 'u' if it is escaped as \u00XX, 'v' if it must be checked to be UTF-8,
+ * or '.' if it is copied as it is.
+ */
+static const char JSON_ESCAPES[] =
+  "uuuuuuuubtnufruu"  // 0x00
+  "uuuuuuuuuuuuuuuu"  // 0x10
+  "..\"............."  // 0x20
+  "................"  // 0x30
+  "................"  // 0x40
+  "............\\..."  // 0x50
+  "................"  // 0x60
+  "................"  // 0x70
+  "vvvvvvvvvvvvvvvv"  // 0x80
+  "vvvvvvvvvvvvvvvv"  // 0x90
+  "vvvvvvvvvvvvvvvv"  // 0xA0
+  "vvvvvvvvvvvvvvvv"  // 0xB0
+  "vvvvvvvvvvvvvvvv"  // 0xC0
+  "vvvvvvvvvvvvvvvv"  // 0xD0
+  "vvvvvvvvvvvvvvvv"  // 0xE0
+  "vvvvvvvvvvvvvvvv"; // 0xF0
+
+
+/**
+ * Returns the length of the UTF-8 character that starts at p, before end, or
+ * 0 if the bytes there aren't one.
+ */
+size_t utf8_length(const char * p, const char * end) {
+  const unsigned char lead = *p;
+  const size_t n = lead >= 0xF5 ? 0 : lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3
+                 : lead >= 0xC2 ? 2 : 0;
+  if (!n || (size_t) (end - p) < n) return 0;
+  for (size_t i = 1; i < n; ++i) {
+    if ((p[i] & 0xC0) != 0x80) return 0;
+  }
+  return n;
+}
+
+
+/**
+ * Inserts text as a quoted JSON string.  Runs of bytes that need no escape are
+ * copied in one piece.  Bytes that aren't part of a UTF-8 character, as in a
+ * blob, are escaped as \u00XX.
+ */
+void insert_json_text(ostream & out, const char * text, const size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  const char * run = text, * end = text + size;
+  out.put('"');
+  for (const char * p = text; p < end; ++p) {
+    char e = JSON_ESCAPES[(unsigned char) *p];
+    if (e == '.') continue;
+    if (e == 'v') {
+      const size_t n = utf8_length(p, end);
+      if (n) {
+        p += n - 1;
+        continue;
+      }
+      e = 'u';
+    }
+    out.write(run, p - run);
+    const char escape[] = {
+      '\\', e, '0', '0', hex[(*p >> 4) & 0xF], hex[*p & 0xF]
+    };
+    out.write(escape, e == 'u' ? 6 : 2);
+    run = p + 1;
+  }
+  out.write(run, end - run);
+  out.put('"');
+}
+
+
+/**
+ * Inserts a cell as a JSON value: numbers unquoted, text quoted and NULL as
+ * null.  JSON has no infinity, so infinite reals are null too.
+ */
+void insert_json_value(ostream & out, const Cell & cell) {
+  char buffer[32];
+  size_t length = 0;
+  switch (cell.type) {
+    case Cell::INTEGER:
+      out.write(buffer, Util::format(cell.integer, buffer));
+      break;
+    case Cell::REAL:
+      if (cell.real > DBL_MAX || cell.real < -DBL_MAX) {
+        out << "null";
+      } else {
+        const char * text = cell.to_text(buffer, length);
+        out.write(text, length);
+      }
+      break;
+    case Cell::TEXT:
+      insert_json_text(out, cell.text, cell.size);
+      break;
+    default:
+      out << "null";
+  }
+}
+
+
+/**
+ * Returns the keys of the JSON objects holding the rows: each column name,
+ * quoted and followed by a colon.  With no headings, the rows are arrays and
+ * the keys are empty.
+ */
+template <typename T>
+vector<string> json_keys(const T & names, const bool do_show_headings) {
+  vector<string> keys;
+  for (typename T::const_iterator i = names.begin(); i != names.end(); ++i) {
+    stringstream ss;
+    if (do_show_headings) {
+      insert_json_text(ss, i -> data(), i -> size());
+      ss << ':';
+    }
+    keys.push_back(ss.str());
+  }
+  return keys;
+}
+
+
+/**
+ * Inserts a row as a JSON object, or an array if the keys are empty.
+ */
+void insert_json_row(ostream & out, const vector<string> & keys,
+                     const vector<Cell> & row)
+{
+  const bool objects = !keys.empty() && !keys[0].empty();
+  for (size_t c = 0; c < row.size(); ++c) {
+    out << (c ? ',' : objects ? '{' : '[') << keys[c];
+    insert_json_value(out, row[c]);
+  }
+  out << (objects ? '}' : ']');
+}
+
+
+/**
+ * Inserts a ResultSet as JSON: an array of rows, or a line for each row.
+ */
+void insert_json(const ResultSet * rs, ostream & out,
+                 const bool do_show_headings, const bool lines)
+{
+  if (!rs || !rs -> rows) {
+    if (!lines) out << "[]\n";
+    return;
+  }
+  const vector<string> keys = json_keys(rs -> headers, do_show_headings);
+  vector<Cell> row(rs -> columns);
+  for (size_t r = 0; r < rs -> rows; ++r) {
+    for (size_t c = 0; c < rs -> columns; ++c) row[c] = rs -> cell(r, c);
+    if (!lines) out << (r ? ",\n" : "[\n");
+    insert_json_row(out, keys, row);
+    if (lines) out << '\n';
+  }
+  if (!lines) out << "\n]\n";
+  out.flush();
+}
+
+
+/**
+ * Inserts the rows of a Cursor as JSON, as they are read: an array of rows,
+ * or a line for each row.
+ */
+void stream_json(Cursor & cursor, ostream & out, const bool do_show_headings,
+                 const bool lines)
+{
+  vector<string> names;
+  for (size_t c = 0; c < cursor.columns(); ++c) {
+    names.push_back(cursor.name(c));
+  }
+  const vector<string> keys = json_keys(names, do_show_headings);
+  vector<Cell> row(names.size());
+  bool first = true;
+  for (; cursor.next(); first = false) {
+    for (size_t c = 0; c < row.size(); ++c) row[c] = cursor.cell(c);
+    if (!lines) out << (first ? "[\n" : ",\n");
+    insert_json_row(out, keys, row);
+    if (lines) out << '\n';
+  }
+  if (!lines) out << (first ? "[]\n" : "\n]\n");
+  out.flush();
+}
+
+
+/**
+ * Makes this Formatter avaiable for use within the program.
+ */
+void JsonFormatter::init() {
+  static JsonFormatter instance("json",
+    "An array of rows, as JSON objects keyed by column.");
+}
+
+
+/**
+ * Inserts data as a JSON array.
+ */
+void JsonFormatter::insert(const ResultSet * rs, ostream & out) const {
+  insert_json(rs, out, do_show_headings, false);
+}
+
+
+/**
+ * Streams data as a JSON array.
+ */
+void JsonFormatter::stream(Cursor & cursor, ostream & out) const {
+  stream_json(cursor, out, do_show_headings, false);
+}
+
+
+/**
+ * Makes this Formatter avaiable for use within the program.
+ */
+void NdjsonFormatter::init() {
+  static NdjsonFormatter instance("ndjson",
+    "A line for each row, as a JSON object keyed by column.");
+}
+
+
+/**
+ * Inserts data as newline delimited JSON.
+ */
+void NdjsonFormatter::insert(const ResultSet * rs, ostream & out) const {
+  insert_json(rs, out, do_show_headings, true);
+}
+
+
+/**
+ * Streams data as newline delimited JSON.
+ */
+void NdjsonFormatter::stream(Cursor & cursor, ostream & out) const {
+  stream_json(cursor, out, do_show_headings, true);
+}
+
+
 /**
  * Makes this Formatter avaiable for use within the program.
  */
@@ -220,6 +596,14 @@ void NullFormatter::insert(const ResultSet * rs, ostream & out) const {
 }
 
 
+/**
+ * Streams data separated by \0 characters.
+ */
+void NullFormatter::stream(Cursor & cursor, ostream & out) const {
+  stream_delimited(cursor, out, string("\0", 1), do_show_headings);
+}
+
+
 /**
  * Makes this Formatter avaiable for use within the program.
  */
@@ -230,13 +614,14 @@ void GroupedFormatter::init() {
 
 
 /**
- * Determines how many levels should be auto-grouped.
+ * Determines how many levels should be auto-grouped, from the widths of the
+ * columns and how often their values change (see get_widths).
  */
-int get_grouped_level_count(const ResultSet * rs, const vector<size_t> & widths)
+size_t get_grouped_level_count(const size_t rows,
+                               const vector<size_t> & widths,
+                               const vector<size_t> & runs)
 {
-  if (!rs) return 0;  // Sanity check.
-
-  size_t width = 0, length = rs -> rows, XX = 4;
+  size_t width = 0, length = rows, XX = 4;
   for (size_t i = 0, e = widths.size(); i != e; ++i) width += widths[i];
   size_t min_area = length * width;
   
@@ -255,27 +640,19 @@ int get_grouped_level_count(const ResultSet * rs, const vector<size_t> & widths)
   // will be 3.
   vector<size_t> areas(widths.size(), width * length);
   
-  string prev;
-  for (size_t c = 0, cols = rs -> columns; c < cols; ++c) {
-    // test each row in the column to see if it is a duplicate of the previous
-    // row.  If so, it will be de-duped in the output.  If not, it means an
-    // extra row will be added, so we adjust the new_len variable accordingly.
-    prev = "";
-    for (size_t r = 0, rows = rs -> rows; r < rows; ++r) {
-      if (prev != rs -> data[r][c]) {
-        ++length;
-        prev = rs -> data[r][c];
-      }
-    }
+  for (size_t c = 0, cols = widths.size(); c < cols; ++c) {
+    // each value in the column that differs from the one above it will be
+    // printed on a row of its own, so it adds a row to the output.
+    length += runs[c];
     // to calculate the new width, we need to consider both the width of the 
     // grouped column and the width of the remaining columns.  we also need to
     // consider the width of the indent.
     width = max(width - widths[c], widths[c]) + XX * (c + 1);
     min_area = min(length * width, min_area);
-    if (c < rs -> columns - 1) areas[c + 1] = width * length;
+    if (c < cols - 1) areas[c + 1] = width * length;
   }
   // Find the rightmost minimum area from all simulated areas.
-  for (size_t c = rs -> columns; c > 0; --c) {
+  for (size_t c = widths.size(); c > 0; --c) {
     if (areas[c - 1] == min_area) return c - 1;
   }
   return 0;
@@ -283,44 +660,53 @@ int get_grouped_level_count(const ResultSet * rs, const vector<size_t> & widths)
 
 
 /**
- * Inserts auto-grouped history, starting with the leftmost columns.
+ * Inserts the headings of auto-grouped history.
  */
-void GroupedFormatter::insert(const ResultSet * rs, ostream & out) const {
-  if (!rs) return;  // Sanity check.
-
-  vector<size_t> widths = get_widths(rs, do_show_headings);
-  size_t levels = get_grouped_level_count(rs, widths);
-
-  if (do_show_headings) {
-    ResultSet::HeadersType::const_iterator h = rs -> headers.begin();
-    for (size_t c = 0, cols = rs -> columns; c < cols; ++c) {
-      if (c < levels) {
-        // if it's a grouped column, print it followed by a newline and an
-        // indent for the next line.
-        out << *h << "\n";
-        for (size_t i = c + 1; i > 0; --i) out << "    ";
+void insert_grouped_headings(const ResultSet * rs, ostream & out,
+                             const vector<size_t> & widths,
+                             const size_t levels)
+{
+  ResultSet::HeadersType::const_iterator h = rs -> headers.begin();
+  for (size_t c = 0, cols = rs -> columns; c < cols; ++c) {
+    if (c < levels) {
+      // if it's a grouped column, print it followed by a newline and an
+      // indent for the next line.
+      out << *h << "\n";
+      for (size_t i = c + 1; i > 0; --i) out << "    ";
+    } else {
+      // if it's not the last column, we set the alignment left and pad the
+      // value with spaces.  Otherwise we just print the value to remove
+      // trailing spaces from the last value.
+      if (c < cols - 1) {
+        out << left << setw(widths[c]) << *h;
       } else {
-        // if it's not the last column, we set the alignment left and pad the
-        // value with spaces.  Otherwise we just print the value to remove
-        // trailing spaces from the last value.
-        if (c < cols - 1) {
-          out << left << setw(widths[c]) << *h;
-        } else {
-          out << *h;
-        }
+        out << *h;
       }
-      ++h;
     }
-    out << endl;
+    ++h;
   }
-  
-  vector<string> prev(levels);
-  string value;
-  for (size_t r = 0, rows = rs -> rows; r < rows; ++r) {
+  out << '\n';
+}
+
+
+/**
+ * Inserts the rows of auto-grouped history.  The values last printed at each
+ * grouped level are kept in prev, which is empty before the first row, and
+ * point into the last row inserted, which must outlive the next call.
+ */
+void insert_grouped_rows(const ResultSet * rs, ostream & out,
+                         const vector<size_t> & widths, const size_t levels,
+                         vector<const Cell *> & prev)
+{
+  static const Cell none;
+  bool first = prev.empty();
+  if (first) prev.assign(levels, &none);
+
+  for (size_t r = 0, rows = rs -> rows; r < rows; ++r, first = false) {
     for (size_t c = 0, cols = rs -> columns; c < cols; ++c) {
-      value = rs -> data[r][c];
+      const Cell & value = rs -> cell(r, c);
       if (c < levels) {
-        if (value != prev[c] || r == 0) {
+        if (first || value != *prev[c]) {
           // The value has not been grouped, 
           out << value;
           if (c < cols - 1) {
@@ -328,13 +714,13 @@ void GroupedFormatter::insert(const ResultSet * rs, ostream & out) const {
             // to the next level in preparation for the next value.
             out << "\n";
             for (size_t i = c + 1; i > 0; --i) out << "    ";
-            for (size_t i = c; i < levels; ++i) prev[i] = "";
+            for (size_t i = c; i < levels; ++i) prev[i] = &none;
           }
-          prev[c] = value;
         } else {
           // The value has been grouped, only print the indent.
           out << "    ";
         }
+        prev[c] = &value;
       } else {
         // Normal (non-grouped) case.
         if (c < cols - 1) {
@@ -344,7 +730,55 @@ void GroupedFormatter::insert(const ResultSet * rs, ostream & out) const {
         }
       }
     }
-    out << endl;
+    out << '\n';
   }
 }
 
+
+/**
+ * Inserts auto-grouped history, starting with the leftmost columns.
+ */
+void GroupedFormatter::insert(const ResultSet * rs, ostream & out) const {
+  if (!rs) return;  // Sanity check.
+
+  vector<size_t> runs;
+  vector<size_t> widths = get_widths(rs, do_show_headings, &runs);
+  size_t levels = get_grouped_level_count(rs -> rows, widths, runs);
+
+  if (do_show_headings) insert_grouped_headings(rs, out, widths, levels);
+  vector<const Cell *> prev;
+  insert_grouped_rows(rs, out, widths, levels, prev);
+  out.flush();
+}
+
+
+/**
+ * Streams auto-grouped history, a window of rows at a time.  The grouping and
+ * the widths are decided from the first window, so a later value that is
+ * wider than those pushes the rest of its row to the right.
+ */
+void GroupedFormatter::stream(Cursor & cursor, ostream & out) const {
+  if (!window_rows) {
+    Formatter::stream(cursor, out);
+    return;
+  }
+
+  ResultSet * rs = cursor.rest(window_rows), * last = 0;
+  if (!rs) return;
+
+  vector<size_t> runs;
+  vector<size_t> widths = get_widths(rs, do_show_headings, &runs);
+  size_t levels = get_grouped_level_count(rs -> rows, widths, runs);
+
+  if (do_show_headings) insert_grouped_headings(rs, out, widths, levels);
+  // Each window is kept until the next has been printed, since the grouped
+  // values are compared with its last row.
+  vector<const Cell *> prev;
+  for (; rs; rs = cursor.rest(window_rows)) {
+    insert_grouped_rows(rs, out, widths, levels, prev);
+    out.flush();
+    if (last) delete last;
+    last = rs;
+  }
+  if (last) delete last;
+}
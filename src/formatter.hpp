@@ -32,6 +32,7 @@ using std::map;
 using std::ostream;
 using std::string;
 
+class Cursor;  // forward declaration.
 class ResultSet;  // forward declaration.
 
 
@@ -52,15 +53,19 @@ class Formatter {
     virtual ~Formatter();
 
     virtual void insert(const ResultSet * rs, ostream & out) const = 0;
+    virtual void stream(Cursor & cursor, ostream & out) const;
 
+    void clip(bool clip);
     void show_headings(bool show);
+    void window(size_t rows);
 
   protected:
     Formatter(const string & name, const string & description);
 
   protected:
     const string name, description;
-    bool do_show_headings;
+    bool do_clip, do_show_headings;
+    size_t window_rows;
 
   // DISALLOWED:
   private:
@@ -88,33 +93,73 @@ class Formatter {
   }
 
 
+/**
+ * Like FORMATTER, but the class also implements a non-static stream, which
+ * prints the rows of a Cursor as they are read rather than reading them all
+ * first.
+ */
+#define STREAMING_FORMATTER(NAME) \
+  class NAME ## Formatter : public Formatter { \
+    public: \
+      static void init(); \
+  \
+    public: \
+      virtual ~NAME ## Formatter() {} \
+      virtual void insert(const ResultSet * rs, ostream & out) const; \
+      virtual void stream(Cursor & cursor, ostream & out) const; \
+  \
+    protected: \
+      NAME ## Formatter(const string & name, const string & description) \
+        : Formatter(name, description) {} \
+  }
+
+
 /**
  * Singleton class that converts a result set into output, spacing all columns
  * evenly using spaces to align columns.  Each column is as wide as its widest
- * element.
+ * element.  Given a window, the widths are decided from that many rows and the
+ * rest are printed as they are read, widening a column (or clipping its text)
+ * to fit a wider value.
  */
-FORMATTER(Spaced);
+STREAMING_FORMATTER(Spaced);
 
 
 /**
  * Singleton class that converts a result set into output, delimiting all
  * columns with commas.
  */
-FORMATTER(Csv);
+STREAMING_FORMATTER(Csv);
+
+
+/**
+ * Singleton class that converts a result set into a JSON array holding an
+ * object for each row, keyed by column name (or an array of the values, if
+ * headings are hidden).
+ */
+STREAMING_FORMATTER(Json);
+
+
+/**
+ * Singleton class that converts a result set into newline delimited JSON: a
+ * line for each row, holding an object as in the json format.
+ */
+STREAMING_FORMATTER(Ndjson);
 
 
 /**
  * Singleton class that converts a result set into output, collapsing repeated
- * values on the left edge if the net result saves printed space.
+ * values on the left edge if the net result saves printed space.  Given a
+ * window, the grouping and widths are decided from that many rows and the
+ * rows are then printed a window at a time.
  */
-FORMATTER(Grouped);
+STREAMING_FORMATTER(Grouped);
 
 
 /**
  * Singleton class that converts a result set into output, delimiting all
  * columns with \0 characters (NULL).
  */
-FORMATTER(Null);
+STREAMING_FORMATTER(Null);
 
 
 }  // namespace ash
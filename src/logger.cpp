@@ -27,6 +27,24 @@ using namespace ash;
 using namespace std;
 
 
+/**
+ * Called instead of exit after a FATAL message, if set.
+ */
+Logger::FatalHandler Logger::fatal_handler = 0;
+
+
+/**
+ * Replaces the default FATAL behavior of exiting the program.  This is for
+ * code running inside the user's shell, which must not exit it.  The handler
+ * is called once the message is written, and then the FATAL statement
+ * returns: the code that logged it carries on to return an error, which
+ * unwinds its callers normally.
+ */
+void Logger::set_fatal_handler(FatalHandler handler) {
+  fatal_handler = handler;
+}
+
+
 /**
  * Converts a string representation of the enum value to the enum code.
  */
@@ -91,10 +109,9 @@ Logger::Logger(const Severity lvl)
     perror("advanced shell history Logger: localtime");
     if (level != FATAL) {
       LOG(FATAL) << "Failed to get localtime on this machine.";  // recurse
-    } else {
-      log << "SESSION " << session_id << ": " << to_str(level) << ": ";
-      return;
     }
+    log << "SESSION " << session_id << ": " << to_str(level) << ": ";
+    return;
   }
 
   // Get the log date format, if one was specified.
@@ -114,12 +131,14 @@ Logger::Logger(const Severity lvl)
 
 
 /**
- * Destroys a Logger, flushing output and exiting the program if the severity
- * level was FATAL.
+ * Destroys a Logger, flushing output and exiting the program (or calling the
+ * fatal handler) if the severity level was FATAL.
  */
 Logger::~Logger() {
   log << endl;
   log.close();
-  if (level == FATAL) exit(1);
+  if (level != FATAL) return;
+  if (!fatal_handler) exit(1);
+  fatal_handler();
 }
 
@@ -51,6 +51,15 @@ enum Severity {
  * a designated log file.
  */
 class Logger : public ostream {
+  // STATIC:
+  public:
+    typedef void (*FatalHandler)();
+    static void set_fatal_handler(FatalHandler handler);
+
+  private:
+    static FatalHandler fatal_handler;
+
+  // NON-STATIC:
   public:
     Logger(const Severity level);
     ~Logger();
@@ -0,0 +1,295 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "merge.hpp"
+
+#include "command.hpp"
+#include "database.hpp"
+#include "logger.hpp"
+
+#include <errno.h>     /* for errno */
+#include <string.h>    /* for strerror */
+#include <sys/stat.h>  /* for stat */
+
+#include <sstream>
+
+
+using namespace ash;
+using namespace std;
+
+
+namespace {
+
+// Each source takes one of sqlite's 62 attachments.
+const size_t BATCH = 62;
+
+}  // namespace
+
+
+/**
+ * Prepares the argument database to have others merged into it.  If
+ * defer_indexes is set, the indexes of command_runs and the trigger that
+ * indexes new texts for search are dropped until the merge is done: building
+ * them once at the end is much faster than updating them row by row, when
+ * more rows are merged than are there already.
+ */
+Merge::Merge(Database & db, const bool defer_indexes) : db(db) {
+  // Sessions are matched to those already merged by start time, pid and host.
+  db.run_script(
+    "CREATE INDEX IF NOT EXISTS sessions_origin\n"
+    "  ON sessions (start_time, pid, hostname);\n"
+    "CREATE TEMP TABLE IF NOT EXISTS merged_sessions (\n"
+    "  n integer primary key,\n"
+    "  old_id integer unique,\n"
+    "  new_id integer,\n"
+    "  fresh integer\n"
+    ");\n"
+    "CREATE TEMP TABLE IF NOT EXISTS merged_directories (\n"
+    "  old_id integer primary key,\n"
+    "  new_id integer\n"
+    ");\n"
+    "CREATE TEMP TABLE IF NOT EXISTS merged_texts (\n"
+    "  old_id integer primary key,\n"
+    "  new_id integer,\n"
+    "  text varchar(1000)\n"
+    ");\n"
+    "CREATE TEMP TABLE IF NOT EXISTS merged_counts (\n"
+    "  sessions integer,\n"
+    "  commands integer\n"
+    ");");
+  if (!defer_indexes) return;
+
+  // The full-text index of the texts is rebuilt in one pass, too.
+  ResultSet * rs = db.exec(
+    "SELECT type, name, sql FROM main.sqlite_master\n"
+    "WHERE (type = 'index' AND tbl_name = 'command_runs' AND sql NOT NULL)\n"
+    "   OR (type = 'trigger' AND name = 'command_texts_insert');");
+  stringstream ss;
+  for (size_t i = 0; rs && i < rs -> rows; ++i) {
+    ss << "DROP " << rs -> cell(i, 0) << " main." << rs -> cell(i, 1) << ";\n";
+    deferred.push_back(rs -> cell(i, 2).str() + ";");
+    if (rs -> cell(i, 0).str() == "trigger") {
+      deferred.push_back("INSERT INTO main.command_search (command_search)\n"
+                         "  VALUES ('rebuild');");
+    }
+  }
+  if (rs) delete rs;
+  if (!deferred.empty() && !db.run_script(ss.str())) deferred.clear();
+}
+
+
+/**
+ * Rebuilds the indexes dropped by the constructor.
+ */
+Merge::~Merge() {
+  stringstream ss;
+  typedef vector<string>::const_iterator iter;
+  for (iter i = deferred.begin(), e = deferred.end(); i != e; ++i) {
+    ss << *i << "\n";
+  }
+  if (!deferred.empty() && !db.run_script(ss.str())) {
+    LOG(ERROR) << "Failed to rebuild the indexes of " << db.filename();
+  }
+  ResultSet * rs = db.exec("DROP TABLE IF EXISTS temp.merged_sessions;");
+  if (rs) delete rs;
+  rs = db.exec("DROP TABLE IF EXISTS temp.merged_directories;");
+  if (rs) delete rs;
+  rs = db.exec("DROP TABLE IF EXISTS temp.merged_texts;");
+  if (rs) delete rs;
+  rs = db.exec("DROP TABLE IF EXISTS temp.merged_counts;");
+  if (rs) delete rs;
+}
+
+
+/**
+ * Returns the columns of the argument table, other than its id.
+ */
+const vector<string> Merge::columns(const string & table) const {
+  ResultSet * rs = db.exec("PRAGMA main.table_info(" + table + ");");
+  vector<string> names;
+  for (size_t i = 0; rs && i < rs -> rows; ++i) {
+    const string name = rs -> cell(i, 1).str();
+    if (name != "id") names.push_back(name);
+  }
+  if (rs) delete rs;
+  return names;
+}
+
+
+/**
+ * Returns the single number selected by the argument query, or 0.
+ */
+long int Merge::count(const string & query) const {
+  ResultSet * rs = db.exec(query);
+  long int n = rs && rs -> rows == 1 ? rs -> cell(0, 0).integer : 0;
+  if (rs) delete rs;
+  return n;
+}
+
+
+/**
+ * Returns the SQL that merges the history attached as the argument schema.
+ *
+ * The sessions are mapped first: to the id of the same session if it was
+ * already merged, or else to the next unused id, in the order they were
+ * logged.  Directories and texts are added if they are new, and the commands
+ * are copied with their sessions, directories and texts mapped.  A text keeps
+ * its id unless that holds a different text here, when it is kept under the
+ * next free probe (see Command::get_free_text_id_sql).  Commands already
+ * merged are ignored by the unique key on their session and number, and so
+ * are the few whose text has no free probe left.
+ */
+const string Merge::merge_sql(const string & schema) const {
+  const string & s = schema;
+  const vector<string> session_columns = columns("sessions");
+  const vector<string> run_columns = columns("command_runs");
+  stringstream names, values;
+  for (size_t i = 0; i < session_columns.size(); ++i) {
+    names << ", " << session_columns[i];
+    values << ", s." << session_columns[i];
+  }
+  const string sessions = names.str(), session_values = values.str();
+  names.str("");
+  values.str("");
+  for (size_t i = 0; i < run_columns.size(); ++i) {
+    const string & name = run_columns[i];
+    names << (i ? ", " : "") << name;
+    values << (i ? ", " : "")
+           << (name == "session_id" ? "m.new_id"
+               : name == "dir_id" ? "d.new_id"
+               : name == "text_id"
+                 ? "CASE WHEN x.old_id IS NULL THEN c.text_id ELSE x.new_id END"
+                 : "c." + name);
+  }
+  const string main_texts = "main.command_texts";
+  const string text_id = Command::get_text_id_sql("st.text", main_texts);
+  const string moved_id =
+    Command::get_text_id_sql("merged_texts.text", main_texts);
+  const string free_id = Command::get_free_text_id_sql("x.text", main_texts);
+  stringstream probes;
+  for (int i = 0; i < Command::TEXT_PROBES; ++i) {
+    probes << "INSERT OR IGNORE INTO main.command_texts (id, text)\n"
+           << "  SELECT id, text FROM (\n"
+           << "    SELECT " << free_id << " AS id, x.text AS text\n"
+           << "    FROM temp.merged_texts AS x\n"
+           << "    WHERE " << Command::get_text_id_sql("x.text", main_texts)
+           << " IS NULL)\n"
+           << "  WHERE id NOT NULL;\n";
+  }
+
+  stringstream ss;
+  ss << "DELETE FROM temp.merged_sessions;\n"
+     << "INSERT INTO temp.merged_sessions (old_id, new_id, fresh)\n"
+     << "  SELECT s.id, (\n"
+     << "    SELECT t.id FROM main.sessions AS t\n"
+     << "    WHERE t.start_time = s.start_time AND t.pid = s.pid\n"
+     << "      AND t.hostname IS s.hostname), 0\n"
+     << "  FROM " << s << ".sessions AS s ORDER BY s.id;\n"
+     << "UPDATE temp.merged_sessions SET fresh = 1, new_id = n + MAX(\n"
+     << "    (SELECT COALESCE(MAX(id), 0) FROM main.sessions),\n"
+     << "    COALESCE((SELECT seq FROM main.sqlite_sequence\n"
+     << "              WHERE name = 'sessions'), 0))\n"
+     << "  WHERE new_id IS NULL;\n"
+     << "INSERT INTO main.sessions (id" << sessions << ")\n"
+     << "  SELECT m.new_id" << session_values << "\n"
+     << "  FROM " << s << ".sessions AS s\n"
+     << "    INNER JOIN temp.merged_sessions AS m ON m.old_id = s.id\n"
+     << "  WHERE m.fresh ORDER BY s.id;\n"
+     << "INSERT INTO temp.merged_counts (sessions) VALUES (changes());\n"
+     // Sessions that have ended since they were last merged.
+     << "UPDATE main.sessions SET\n"
+     << "  end_time = (SELECT s.end_time FROM " << s << ".sessions AS s\n"
+     << "    INNER JOIN temp.merged_sessions AS m ON m.old_id = s.id\n"
+     << "    WHERE m.new_id = sessions.id),\n"
+     << "  duration = (SELECT s.duration FROM " << s << ".sessions AS s\n"
+     << "    INNER JOIN temp.merged_sessions AS m ON m.old_id = s.id\n"
+     << "    WHERE m.new_id = sessions.id)\n"
+     << "  WHERE end_time IS NULL AND id IN (\n"
+     << "    SELECT new_id FROM temp.merged_sessions WHERE NOT fresh);\n"
+     << "INSERT OR IGNORE INTO main.directories (path)\n"
+     << "  SELECT path FROM " << s << ".directories;\n"
+     << "DELETE FROM temp.merged_directories;\n"
+     << "INSERT INTO temp.merged_directories (old_id, new_id)\n"
+     << "  SELECT sd.id, d.id FROM " << s << ".directories AS sd\n"
+     << "    INNER JOIN main.directories AS d ON d.path = sd.path;\n"
+     // Texts under a probe may be here under their hash already.
+     << "INSERT OR IGNORE INTO main.command_texts (id, text)\n"
+     << "  SELECT id, text FROM " << s << ".command_texts AS st\n"
+     << "  WHERE id = ash_hash(text) OR " << text_id << " IS NULL;\n"
+     << "DELETE FROM temp.merged_texts;\n"
+     << "INSERT INTO temp.merged_texts (old_id, text)\n"
+     << "  SELECT st.id, st.text FROM " << s << ".command_texts AS st\n"
+     << "  WHERE NOT EXISTS (SELECT 1 FROM main.command_texts AS t\n"
+     << "                    WHERE t.id = st.id AND t.text = st.text);\n"
+     << probes.str()
+     << "UPDATE temp.merged_texts SET new_id = " << moved_id << ";\n"
+     << "INSERT OR IGNORE INTO main.command_runs (" << names.str() << ")\n"
+     << "  SELECT " << values.str() << "\n"
+     << "  FROM " << s << ".command_runs AS c\n"
+     << "    INNER JOIN temp.merged_sessions AS m ON m.old_id = c.session_id\n"
+     << "    INNER JOIN temp.merged_directories AS d ON d.old_id = c.dir_id\n"
+     << "    LEFT JOIN temp.merged_texts AS x ON x.old_id = c.text_id\n"
+     << "  ORDER BY c.id;\n"
+     << "INSERT INTO temp.merged_counts (commands) VALUES (changes());\n";
+  return ss.str();
+}
+
+
+/**
+ * Merges the argument history databases, attaching up to 62 at a time and
+ * merging each batch in one transaction.  Sources that are missing, are the
+ * database itself, or have a schema this program can't read (and can't
+ * migrate) are skipped with a warning.  Returns the number of commands added,
+ * and adds the number of sessions to the argument count.
+ */
+long int Merge::merge(const vector<string> & sources, long int & sessions) {
+  for (size_t first = 0; first < sources.size(); first += BATCH) {
+    vector<string> schemas;
+    stringstream sql;
+    for (size_t i = first; i < sources.size() && i < first + BATCH; ++i) {
+      struct stat st;
+      if (stat(sources[i].c_str(), &st)) {
+        LOG(WARNING) << "Skipping " << sources[i] << ": " << strerror(errno);
+        continue;
+      }
+      if (sources[i] == db.filename()) {
+        LOG(WARNING) << "Skipping " << sources[i] << ": it is the target";
+        continue;
+      }
+      stringstream schema;
+      schema << "merge" << (i - first);
+      if (!db.attach(sources[i], schema.str())) continue;
+      schemas.push_back(schema.str());
+      sql << merge_sql(schema.str());
+    }
+    if (!schemas.empty() && !db.run_script(sql.str())) {
+      LOG(ERROR) << "Failed to merge " << schemas.size() << " databases into "
+                 << db.filename();
+    }
+    typedef vector<string>::const_iterator iter;
+    for (iter i = schemas.begin(), e = schemas.end(); i != e; ++i) {
+      ResultSet * rs = db.exec("DETACH DATABASE " + *i + ";");
+      if (rs) delete rs;
+    }
+  }
+  sessions +=
+    count("SELECT COALESCE(SUM(sessions), 0) FROM temp.merged_counts;");
+  const long int commands =
+    count("SELECT COALESCE(SUM(commands), 0) FROM temp.merged_counts;");
+  ResultSet * rs = db.exec("DELETE FROM temp.merged_counts;");
+  if (rs) delete rs;
+  return commands;
+}
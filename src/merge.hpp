@@ -0,0 +1,67 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_MERGE__
+#define __ASH_MERGE__
+
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace ash {
+
+class Database;  // Forward declaration.
+
+
+/**
+ * Merges other history databases (from other hosts, say) into a history
+ * database.  Each batch of sources is attached and copied in a single
+ * transaction, a table at a time, rather than a row at a time.
+ *
+ * Sessions get new ids.  A session that was already merged (the same host,
+ * pid and start time) keeps its id, and only its commands that are missing
+ * are added, so merging the same source again is harmless.  Directories and
+ * command texts are shared with those already in the history.
+ */
+class Merge {
+  public:
+    Merge(Database & db, const bool defer_indexes);
+    ~Merge();
+
+    long int merge(const vector<string> & sources, long int & sessions);
+
+  private:
+    const vector<string> columns(const string & table) const;
+    long int count(const string & query) const;
+    const string merge_sql(const string & schema) const;
+
+  private:
+    Database & db;
+    vector<string> deferred;
+
+  // DISALLOWED:
+  private:
+    Merge(const Merge & other);
+    Merge & operator = (const Merge & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_MERGE__ */
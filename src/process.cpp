@@ -0,0 +1,163 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "process.hpp"
+
+#include "logger.hpp"
+
+#include <errno.h>   /* for errno, EINTR */
+#include <fcntl.h>   /* for open, O_RDONLY */
+#include <stdio.h>   /* for popen, pclose, fgets, snprintf */
+#include <stdlib.h>  /* for atoi, strtol */
+#include <string.h>  /* for memchr, strerror, strlen */
+#include <unistd.h>  /* for close, read */
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>  /* for sysctl, kinfo_proc */
+#endif
+
+#include <map>
+
+
+using namespace ash;
+using namespace std;
+
+
+/**
+ * Returns the process with the argument pid, looking it up on first use.
+ * The processes are never freed, since a program asks about only a few.
+ */
+const Process & Process::get(const pid_t pid) {
+  static map<pid_t, Process *> known;
+  map<pid_t, Process *>::iterator i = known.find(pid);
+  if (i != known.end()) return *(i -> second);
+  Process * process = new Process(pid);
+  known[pid] = process;
+  return *process;
+}
+
+
+/**
+ * Looks up the argument process.  Anything that can't be found is left zero
+ * or empty.
+ */
+Process::Process(const pid_t pid)
+  : pid(pid), ppid(0), name()
+{
+  if (!read_proc() && !read_sysctl()) read_ps();
+}
+
+
+/**
+ * Parses /proc/<pid>/stat, which starts: pid (name) state ppid ...
+ *
+ * The name may itself contain spaces and parentheses, so it runs to the last
+ * closing parenthesis in the file.  Returns false if there is no such file.
+ */
+bool Process::read_proc() {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%ld/stat", (long int) pid);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    LOG(DEBUG) << "failed to open " << path << ": " << strerror(errno);
+    return false;
+  }
+
+  // The fields needed are near the start, so one read is enough.
+  char buffer[512];
+  ssize_t size;
+  do {
+    size = read(fd, buffer, sizeof(buffer) - 1);
+  } while (size == -1 && errno == EINTR);
+  close(fd);
+  if (size <= 0) {
+    LOG(DEBUG) << "failed to read " << path << ": " << strerror(errno);
+    return false;
+  }
+  buffer[size] = '\0';
+
+  char * open_paren = (char *) memchr(buffer, '(', size);
+  char * close_paren = 0;
+  if (open_paren) {
+    for (char * c = buffer + size - 1; c > open_paren; --c) {
+      if (*c == ')') {
+        close_paren = c;
+        break;
+      }
+    }
+  }
+  if (!close_paren) {
+    LOG(WARNING) << "unexpected contents of " << path << ": " << buffer;
+    return false;
+  }
+  name.assign(open_paren + 1, close_paren);
+
+  // Skip ") " and the one-character state to reach the ppid.
+  if (close_paren + 4 < buffer + size) {
+    ppid = (pid_t) strtol(close_paren + 4, 0, 10);
+  }
+  return true;
+}
+
+
+/**
+ * Asks the kernel about the process on systems without a procfs.  Returns
+ * false where that isn't supported.
+ */
+bool Process::read_sysctl() {
+#ifdef __APPLE__
+  int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int) pid };
+  struct kinfo_proc info;
+  size_t size = sizeof(info);
+  if (sysctl(mib, 4, &info, &size, 0, 0) == -1 || size == 0) {
+    LOG(DEBUG) << "sysctl found no process " << pid << ": " << strerror(errno);
+    return false;
+  }
+  ppid = info.kp_eproc.e_ppid;
+  name = info.kp_proc.p_comm;
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+/**
+ * Returns the first line of output of ps for the argument pid.
+ */
+const string ps(const char * args, const pid_t pid) {
+  LOG(DEBUG) << "looking at ps output for ps " << args << " " << pid;
+  char command[64];
+  snprintf(command, sizeof(command), "/bin/ps %s %ld", args, (long int) pid);
+  FILE * p = popen(command, "r");
+  if (!p) return "";
+  char buffer[256];
+  char * line = fgets(buffer, sizeof(buffer), p);
+  pclose(p);
+  if (!line) return "";
+  size_t length = strlen(line);
+  if (length && line[length - 1] == '\n') line[length - 1] = '\0';
+  return line;
+}
+
+
+/**
+ * Falls back on ps, which costs two fork and execs.
+ */
+void Process::read_ps() {
+  ppid = (pid_t) atoi(ps("ho ppid", pid).c_str());
+  name = ps("ho command", pid);
+}
@@ -0,0 +1,64 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_PROCESS__
+#define __ASH_PROCESS__
+
+#include <sys/types.h>  /* for pid_t */
+
+#include <string>
+
+using std::string;
+
+namespace ash {
+
+
+/**
+ * What the system reports about a running process.
+ *
+ * Each pid is looked up once and remembered for the life of the program:
+ * /proc/<pid>/stat is read with a single read() where there is a procfs, and
+ * sysctl is asked on OS X.  Only systems with neither run ps.
+ */
+class Process {
+  // STATIC:
+  public:
+    static const Process & get(const pid_t pid);
+
+  // NON-STATIC:
+  private:
+    explicit Process(const pid_t pid);
+    ~Process() {}
+
+    bool read_proc();
+    bool read_sysctl();
+    void read_ps();
+
+  public:
+    const pid_t pid;
+    pid_t ppid;
+    string name;
+
+  // DISALLOWED:
+  private:
+    Process(const Process & other);
+    Process & operator = (const Process & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_PROCESS__ */
@@ -0,0 +1,177 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "recorder.hpp"
+
+#include "command.hpp"
+#include "context.hpp"
+#include "daemon.hpp"
+#include "database.hpp"
+#include "logger.hpp"
+#include "session.hpp"
+#include "shards.hpp"
+#include "unix.hpp"
+
+#include <unistd.h>  /* for access */
+
+#include <iostream>  /* for cerr, endl */
+#include <sstream>   /* for stringstream */
+
+
+using namespace ash;
+using namespace std;
+
+
+/**
+ * Creates a Recorder for the shell with the argument pid.  Nothing is opened
+ * until it is needed.
+ */
+Recorder::Recorder(const string & db_file, const long int shell_pid,
+                   const bool use_daemon)
+  : db_file(db_file), shell_pid(shell_pid), use_daemon(use_daemon), ctx(0),
+    db(0)
+{
+  // Nothing to do.
+}
+
+
+/**
+ * Closes the database, if it was opened.
+ */
+Recorder::~Recorder() {
+  if (ctx) delete ctx;
+  if (db) delete db;
+}
+
+
+/**
+ * Returns the context of the current session, loading it again if the
+ * session has changed since it was last used.
+ */
+const Context & Recorder::context() {
+  const long int session_id = unix::env_int("ASH_SESSION_ID");
+  if (ctx && ctx -> session_id != session_id) {
+    delete ctx;
+    ctx = 0;
+  }
+  if (!ctx) ctx = new Context(session_id, shell_pid);
+  return *ctx;
+}
+
+
+/**
+ * Returns the database that new rows are written to, opening it on first use.
+ * If the history is sharded by month, this moves on to the next shard when
+ * the month changes.
+ */
+Database & Recorder::database() {
+  const string file = Shards::current(db_file);
+  if (db && db -> filename() != file) {
+    delete db;
+    db = 0;
+  }
+  if (!db) db = new Database(file);
+  return *db;
+}
+
+
+/**
+ * Runs the argument SQL in the file holding the session with the argument
+ * id.  That is the current database unless the session began in an earlier
+ * month's shard, which is only opened if it can still be written.
+ */
+ResultSet * Recorder::exec(const long int session_id, const string & sql) {
+  const string file = Shards::of_id(db_file, session_id);
+  if (file == Shards::current(db_file)) return database().exec(sql);
+  if (access(file.c_str(), W_OK)) {
+    LOG(WARNING) << "Skipping session " << session_id << ": can't write "
+                 << file;
+    return 0;
+  }
+  Database shard(file);
+  return shard.exec(sql);
+}
+
+
+/**
+ * Returns the current session id, inserting a new session if ASH_SESSION_ID
+ * is unset or doesn't name an open session.
+ */
+long int Recorder::begin_session() {
+  const long int id = unix::env_int("ASH_SESSION_ID");
+  if (id) {
+    stringstream ss;
+    ss << "select count(*) as session_cnt from sessions where id = " << id
+       << " and duration is null;";
+    ResultSet * rs = exec(id, ss.str());
+    bool found = rs && rs -> rows == 1;
+    if (rs) delete rs;
+    if (found) return id;
+    cerr << "ERROR: session_id(" << id << ") not found, "
+         << "creating new session." << endl << ss.str() << endl;
+  }
+
+  Session session;
+  long int session_id = 0;
+  if (!use_daemon || !Daemon::insert(db_file, session, &session_id)) {
+    // The daemon may have written the session even so, without a reply.
+    session_id = database().insert_session(&session);
+  }
+  return session_id;
+}
+
+
+/**
+ * Records a command entered in the current session.
+ */
+void Recorder::record(const string & command, const int rval,
+                      const int start, const int end, const int number,
+                      const string & pipes)
+{
+  Command com(context(), command, rval, start, end, number, pipes);
+  // Hand the row to the daemon if one is running, otherwise write it here.
+  if (!use_daemon || !Daemon::insert(db_file, com)) {
+    database().insert(&com);
+  }
+}
+
+
+/**
+ * Marks the current session as ended and forgets its context.  The database
+ * is closed, since a session that has ended logs nothing more.
+ */
+void Recorder::end_session() {
+  const long int session_id = unix::env_int("ASH_SESSION_ID");
+  if (!session_id) {
+    LOG(ERROR) << "Can't end the current session: ASH_SESSION_ID undefined.";
+    return;
+  }
+
+  const string sql = Session::get_close_session_sql();
+  Context::remove(session_id, shell_pid);
+  // The daemon only writes to the current shard.
+  const bool current = Shards::of_id(db_file, session_id)
+    == Shards::current(db_file);
+  if (!current || !use_daemon || !Daemon::exec(db_file, sql)) {
+    ResultSet * rs = exec(session_id, sql);
+    if (rs) delete rs;
+    if (current) database().checkpoint();
+  }
+  if (ctx) delete ctx;
+  if (db) delete db;
+  ctx = 0;
+  db = 0;
+}
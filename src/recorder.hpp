@@ -0,0 +1,72 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_RECORDER__
+#define __ASH_RECORDER__
+
+#include <string>
+
+using std::string;
+
+namespace ash {
+
+class Context;  // Forward declaration.
+class Database;  // Forward declaration.
+class ResultSet;  // Forward declaration.
+
+
+/**
+ * Records the sessions and commands of one shell.  This is the logging core
+ * shared by _ash_log, which runs once per prompt, and the shell builtins,
+ * which keep a Recorder (and its database connection) for the life of the
+ * shell.
+ *
+ * If use_daemon is set, rows are handed to ashd when it is running and the
+ * database is only opened as a fallback.
+ */
+class Recorder {
+  public:
+    Recorder(const string & db_file, const long int shell_pid,
+             const bool use_daemon);
+    ~Recorder();
+
+    long int begin_session();
+    void end_session();
+    void record(const string & command, const int rval, const int start,
+                const int end, const int number, const string & pipes);
+
+  private:
+    const Context & context();
+    Database & database();
+    ResultSet * exec(const long int session_id, const string & sql);
+
+  private:
+    const string db_file;
+    const long int shell_pid;
+    const bool use_daemon;
+    Context * ctx;
+    Database * db;
+
+  // DISALLOWED:
+  private:
+    Recorder(const Recorder & other);
+    Recorder & operator = (const Recorder & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_RECORDER__ */
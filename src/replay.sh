@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+#   Copyright 2017 Carl Anderson
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+#
+# Replays a recorded shell session with the binaries in a directory, printing
+# the mean time (in ms) that each of them took per invocation:
+#
+#   ./replay.sh [BIN_DIR] [ROUNDS]
+#
+# Each round logs the session's commands with _ash_log, then runs each saved
+# query with ash_query.  The history starts empty and grows by a session each
+# round.  This is the training run and the benchmark for make pgo.
+#
+
+BIN_DIR="$( cd "${1:-.}" && pwd )"
+ROUNDS="${2:-10}"
+SRC_DIR="$( cd "$( dirname "${0}" )" && pwd )"
+
+# _ash_log records the terminal of each command, so it needs one.
+if ! tty -s; then
+  exec script -qec "'${0}' '${BIN_DIR}' '${ROUNDS}'" /dev/null < /dev/null
+fi
+
+# Keep the replay away from the real history, config and daemon.
+WORK="$( mktemp -d )"
+trap 'rm -rf "${WORK}"' EXIT
+unset $( compgen -v ASH_CFG_ ) ASH_SESSION_ID
+export HOME="${WORK}"
+source "${SRC_DIR}/../config"
+unset ASH_CFG_DAEMON_SOCKET
+export $( compgen -v ASH_CFG_ )
+mkdir -p "${HOME}/.ash"
+cp "${SRC_DIR}/../queries" "${HOME}/.ash/queries"
+QUERIES=( $( "${BIN_DIR}/ash_query" -Q | awk 'NR > 1 { print $1 }' ) )
+
+# The recorded session: the directory, exit code and text of each command.
+SESSION=(
+  "src 0 git status"
+  "src 0 vim database.cpp"
+  "src 2 make"
+  "src 0 vim database.cpp"
+  "src 0 make"
+  "src 0 ./ash_query -q POPULAR"
+  "src 0 git diff"
+  "src 0 git commit -a -m 'Fix the build'"
+  ". 0 ls -la"
+  ". 0 cd man"
+  "man 0 man ./ash_query.1"
+  "man 1 grep -rn ASH_CFG_ ."
+  "man 0 cd .."
+  ". 0 tar -czf /tmp/backup.tar.gz src man"
+  ". 0 ssh build-host uptime"
+  ". 130 tail -f /var/log/syslog"
+  ". 0 history | tail"
+  ". 0 git log --oneline | head -20"
+  ". 0 git push origin master"
+  ". 0 exit"
+)
+
+for entry in "${SESSION[@]}"; do
+  mkdir -p "${WORK}/${entry%% *}"
+done
+
+now() {
+  date +%s%N
+}
+
+LOG_NS=0 LOG_RUNS=0 QUERY_NS=0 QUERY_RUNS=0
+for (( round = 0; round < ROUNDS; ++round )); do
+  start=$( now )
+  export ASH_SESSION_ID="$( "${BIN_DIR}/_ash_log" -S )"
+  n=0
+  for entry in "${SESSION[@]}"; do
+    read dir rval command <<< "${entry}"
+    cd "${WORK}/${dir}"
+    when=$(( 1500000000 + round * 1000 + ++n ))
+    "${BIN_DIR}/_ash_log" -c "${command}" -e "${rval}" -s "${when}" \
+      -f "${when}" -n "${n}" -p "${rval}"
+  done
+  "${BIN_DIR}/_ash_log" -E
+  LOG_NS=$(( LOG_NS + $( now ) - start ))
+  LOG_RUNS=$(( LOG_RUNS + n + 2 ))
+
+  start=$( now )
+  for query in "${QUERIES[@]}"; do
+    "${BIN_DIR}/ash_query" -q "${query}" > /dev/null
+  done
+  QUERY_NS=$(( QUERY_NS + $( now ) - start ))
+  QUERY_RUNS=$(( QUERY_RUNS + ${#QUERIES[@]} ))
+done
+
+awk -v ns="${LOG_NS}" -v n="${LOG_RUNS}" \
+  'BEGIN { printf "_ash_log %.3f\n", ns / n / 1000000 }'
+awk -v ns="${QUERY_NS}" -v n="${QUERY_RUNS}" \
+  'BEGIN { printf "ash_query %.3f\n", ns / n / 1000000 }'
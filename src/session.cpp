@@ -59,21 +59,21 @@ void Session::register_table() {
  * Initialize a Session object.
  */
 Session::Session() {
-  values["time_zone"] = unix::time_zone();
-  values["start_time"] = unix::time();
-  values["ppid"] = unix::ppid();
-  values["pid"] = unix::pid();
-  values["tty"] = unix::tty();
-  values["uid"] = unix::uid();
-  values["euid"] = unix::euid();
-  values["logname"] = unix::login_name();
-  values["hostname"] = unix::host_name();
-  values["host_ip"] = unix::host_ip();
-  values["shell"] = unix::shell();
-  values["sudo_user"] = unix::env("SUDO_USER");
-  values["sudo_uid"] = unix::env("SUDO_UID");
-  values["ssh_client"] = unix::env("SSH_CLIENT");
-  values["ssh_connection"] = unix::env("SSH_CONNECTION");
+  set("time_zone", unix::time_zone());
+  set("start_time", unix::time());
+  set("ppid", unix::ppid());
+  set("pid", unix::pid());
+  set("tty", unix::tty());
+  set("uid", unix::uid());
+  set("euid", unix::euid());
+  set("logname", unix::login_name());
+  set("hostname", unix::host_name());
+  set("host_ip", unix::host_ip());
+  set("shell", unix::shell());
+  set("sudo_user", unix::env("SUDO_USER"));
+  set("sudo_uid", unix::env("SUDO_UID"));
+  set("ssh_client", unix::env("SSH_CLIENT"));
+  set("ssh_connection", unix::env("SSH_CONNECTION"));
 }
 
 
@@ -96,12 +96,12 @@ const string Session::get_name() const {
 /**
  * Returns a query to finalize this Session in the sessions table.
  */
-const string Session::get_close_session_sql() const {
+const string Session::get_close_session_sql() {
   stringstream ss;
   ss << "UPDATE sessions \n"
      << "SET \n"
      << "  end_time = " << unix::time() << ", \n"
      << "  duration = " << unix::time() << " - start_time \n"
-     << "WHERE id == " << unix::env("ASH_SESSION_ID") << "; ";
+     << "WHERE id == " << unix::env_int("ASH_SESSION_ID") << "; ";
   return ss.str();
 }
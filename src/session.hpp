@@ -33,13 +33,13 @@ namespace ash {
  */
 class Session : public DBObject {
   public:
+    static const string get_close_session_sql();
     static void register_table();
 
   public:
     Session();
     virtual ~Session();
 
-    virtual const string get_close_session_sql() const;
     virtual const string get_name() const;
 };
 
@@ -0,0 +1,372 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#include "shards.hpp"
+
+#include "config.hpp"
+#include "unix.hpp"
+
+#include <ctype.h>     /* for isalnum */
+#include <dirent.h>    /* for opendir, readdir, closedir */
+#include <stdio.h>     /* for sscanf, snprintf */
+
+#include <algorithm>
+#include <set>
+
+// This hack silences a warning when compiling on a 64 bit platform with
+// -ansi and -pedantic flags enabled.
+// The original g++ complaint is that 'long long' is deprecated.
+#ifdef __LP64__
+#define SQLITE_INT64_TYPE long int
+#endif
+#include "sqlite3.h"
+
+
+using namespace ash;
+using namespace std;
+
+
+// The number of ids reserved for each month's shard.
+static const long int IDS_PER_MONTH = 1000000000L;
+
+// Each host's files take the ids from a multiple of 2^48 on, above the
+// ranges of the months, so ids are unique across hosts as well.
+static const int HOST_SHIFT = 48;
+static const long int HOST_SLOTS = 1L << (63 - HOST_SHIFT);
+
+
+/**
+ * Returns the argument database filename without its .db extension.
+ */
+static const string stem(const string & db_file) {
+  const size_t n = db_file.size();
+  if (n > 3 && db_file.compare(n - 3, 3, ".db") == 0) {
+    return db_file.substr(0, n - 3);
+  }
+  return db_file;
+}
+
+
+/**
+ * Returns the file of the argument history database for the argument host
+ * and month (yyyymm): ~/.ash/history-2026-10@host.db for example.  Either
+ * part is left out if it is empty (or 0).
+ */
+static const string name(const string & db_file, const string & host,
+                         const long int month)
+{
+  if (host.empty() && !month) return db_file;
+  char suffix[32] = "";
+  if (month) {
+    snprintf(suffix, sizeof(suffix), "-%04ld-%02ld", month / 100, month % 100);
+  }
+  return stem(db_file) + suffix + (host.empty() ? "" : "@" + host) + ".db";
+}
+
+
+/**
+ * Splits the name of a file in the directory of a history database into its
+ * month (yyyymm) and host, either of which may be absent (0 or empty).
+ * Returns false if it isn't one of the history database's files.
+ */
+static bool parse(const string & name, const string & prefix, long int & month,
+                  string & host)
+{
+  const size_t n = name.size(), p = prefix.size();
+  if (n < p + 3 || name.compare(0, p, prefix) != 0) return false;
+  if (name.compare(n - 3, 3, ".db") != 0) return false;
+  size_t pos = p;
+  month = 0;
+  int year = 0, mon = 0, end = 0;
+  if (sscanf(name.c_str() + pos, "-%4d-%2d%n", &year, &mon, &end) == 2
+      && end == 8)
+  {
+    month = year * 100L + mon;
+    pos += end;
+  }
+  host = "";
+  if (pos < n - 3 && name[pos] == '@') {
+    host = name.substr(pos + 1, n - 3 - pos - 1);
+    pos = n - 3;
+  }
+  return pos == n - 3 && (month || !host.empty() || n == p + 3);
+}
+
+
+/**
+ * Returns the directory of the argument history database (with its trailing
+ * slash) and the prefix of its files' names.
+ */
+static void split_path(const string & db_file, string & dir, string & prefix) {
+  const string base = stem(db_file);
+  const size_t slash = base.rfind('/');
+  dir = slash == string::npos ? "./" : base.substr(0, slash + 1);
+  prefix = base.substr(slash == string::npos ? 0 : slash + 1);
+}
+
+
+/**
+ * Returns the range of ids (a multiple of 2^48) that the argument file was
+ * created in, or 0 if it can't be read.
+ */
+static long int range_of(const string & file) {
+  sqlite3 * db = 0;
+  long int range = 0;
+  // Read-only connections leave the WAL of a closed database behind.
+  if (sqlite3_open_v2(file.c_str(), &db, SQLITE_OPEN_READWRITE, 0)
+      == SQLITE_OK)
+  {
+    sqlite3_stmt * ps = 0;
+    if (sqlite3_prepare_v2(db, "SELECT MIN(seq) FROM sqlite_sequence;", -1,
+                           &ps, 0) == SQLITE_OK
+        && sqlite3_step(ps) == SQLITE_ROW)
+    {
+      range = sqlite3_column_int64(ps, 0) >> HOST_SHIFT;
+    }
+    sqlite3_finalize(ps);
+  }
+  sqlite3_close(db);
+  return range;
+}
+
+
+/**
+ * Returns the range of ids taken by the files of the argument host: that of
+ * its existing files, or else the first one not taken by another host's
+ * files, starting from one picked by hashing the host's name.  Hosts starting
+ * up at the same time almost always start from different ranges.
+ */
+static long int host_range(const string & db_file, const string & host) {
+  string dir, prefix;
+  split_path(db_file, dir, prefix);
+
+  set<long int> taken;
+  if (DIR * d = opendir(dir.c_str())) {
+    for (struct dirent * entry; (entry = readdir(d)); ) {
+      long int month = 0;
+      string other;
+      if (!parse(entry -> d_name, prefix, month, other) || other.empty()) {
+        continue;
+      }
+      const long int range = range_of(dir + entry -> d_name);
+      if (!range) continue;
+      if (other == host) {
+        closedir(d);
+        return range;
+      }
+      taken.insert(range);
+    }
+    closedir(d);
+  }
+
+  // FNV-1a
+  unsigned long int hash = 2166136261UL;
+  for (size_t i = 0; i < host.size(); ++i) {
+    hash = ((hash ^ (unsigned char) host[i]) * 16777619UL) & 0xffffffffUL;
+  }
+  long int range = 1 + hash % (HOST_SLOTS - 1);
+  while (taken.count(range)) range = 1 + range % (HOST_SLOTS - 1);
+  return range;
+}
+
+
+/**
+ * Returns true if the history is sharded by month:
+ * ASH_CFG_DB_SHARD_BY_MONTH
+ */
+bool Shards::enabled() {
+  return Config::instance().sets("DB_SHARD_BY_MONTH");
+}
+
+
+/**
+ * Returns true if each host writes a file of its own: ASH_CFG_DB_PER_HOST
+ */
+bool Shards::per_host() {
+  return Config::instance().sets("DB_PER_HOST");
+}
+
+
+/**
+ * Returns true if the history may be kept in more than one file, which must
+ * then be read together.
+ */
+bool Shards::split() {
+  return enabled() || per_host();
+}
+
+
+/**
+ * Returns the name this host's files are tagged with, or an empty string if
+ * the hosts share their files.  Characters that may not be safe in a file
+ * name are replaced by underscores.
+ */
+const string Shards::host() {
+  if (!per_host()) return "";
+  string host = unix::host_name();
+  for (string::iterator i = host.begin(), e = host.end(); i != e; ++i) {
+    const char c = *i;
+    if (!isalnum(c) && c != '.' && c != '-' && c != '_') *i = '_';
+  }
+  return host.empty() ? "localhost" : host;
+}
+
+
+/**
+ * Returns the time that the argument month (yyyymm) begins, in UTC.
+ */
+time_t Shards::begins(const long int month) {
+  struct tm utc = tm();
+  utc.tm_year = month / 100 - 1900;
+  utc.tm_mon = month % 100 - 1;
+  utc.tm_mday = 1;
+  return timegm(&utc);
+}
+
+
+/**
+ * Returns the UTC month of the argument time as yyyymm.
+ */
+long int Shards::month(const time_t when) {
+  struct tm utc;
+  gmtime_r(&when, &utc);
+  return (utc.tm_year + 1900) * 100L + utc.tm_mon + 1;
+}
+
+
+/**
+ * Parses a month written as YYYY-MM, returning it as yyyymm.  Returns 0 for
+ * an empty string and -1 if the month is malformed.
+ */
+long int Shards::parse_month(const string & yyyy_mm) {
+  if (yyyy_mm.empty()) return 0;
+  int year = 0, mon = 0, end = 0;
+  if (sscanf(yyyy_mm.c_str(), "%4d-%2d%n", &year, &mon, &end) != 2
+      || end != (int) yyyy_mm.size() || mon < 1 || mon > 12 || year < 1970)
+  {
+    return -1;
+  }
+  return year * 100L + mon;
+}
+
+
+/**
+ * Returns the file that new rows are written to: the shard for this month
+ * and host, or the argument history database if it isn't split.
+ */
+const string Shards::current(const string & db_file) {
+  return name(db_file, host(), enabled() ? month(::time(0)) : 0);
+}
+
+
+/**
+ * Returns this host's shard of the argument history database for the
+ * argument month (yyyymm).
+ */
+const string Shards::file(const string & db_file, const long int month) {
+  return name(db_file, host(), month);
+}
+
+
+/**
+ * Returns the file holding the row with the argument id.  Ids below the
+ * first shard's range were logged before sharding began, so they are in the
+ * history database itself, and ids below the hosts' ranges were logged before
+ * each host had files of its own.
+ */
+const string Shards::of_id(const string & db_file, const long int id) {
+  const long int local = id & ((1L << HOST_SHIFT) - 1);
+  const string tag = id >> HOST_SHIFT ? host() : "";
+  if (!enabled() || local < IDS_PER_MONTH) return name(db_file, tag, 0);
+  return name(db_file, tag, local / IDS_PER_MONTH);
+}
+
+
+/**
+ * Returns the id that the rows of a new database file should follow: the
+ * start of its host's and month's ranges if it is a shard, otherwise 0.
+ */
+long int Shards::first_id(const string & file) {
+  string dir, base, host;
+  split_path(file, dir, base);
+  const size_t at = base.rfind('@');
+  if (at != string::npos) {
+    host = base.substr(at + 1);
+    base.erase(at);
+  }
+  long int month = 0;
+  const size_t n = base.size();
+  int year = 0, mon = 0, end = 0;
+  if (n > 8 && sscanf(base.c_str() + n - 8, "-%4d-%2d%n", &year, &mon, &end)
+      == 2 && end == 8)
+  {
+    month = year * 100L + mon;
+    base.erase(n - 8);
+  }
+
+  long int id = 0;
+  if (enabled()) id += month * IDS_PER_MONTH;
+  if (per_host() && !host.empty()) {
+    id += host_range(dir + base + ".db", host) << HOST_SHIFT;
+  }
+  return id;
+}
+
+
+/**
+ * Returns the existing files of the argument history database that may hold
+ * rows logged between the argument months (yyyymm, inclusive), oldest first:
+ * those of every host.  A bound of 0 leaves that end of the range open.  The
+ * files that aren't monthly shards are included unless the range begins after
+ * sharding did.
+ */
+const vector<string> Shards::find(const string & db_file,
+                                  const long int since, const long int until)
+{
+  string dir, prefix;
+  split_path(db_file, dir, prefix);
+
+  vector<pair<long int, string> > found;
+  if (DIR * d = opendir(dir.c_str())) {
+    for (struct dirent * entry; (entry = readdir(d)); ) {
+      long int month = 0;
+      string host;
+      if (parse(entry -> d_name, prefix, month, host)) {
+        found.push_back(make_pair(month, host));
+      }
+    }
+    closedir(d);
+  }
+  sort(found.begin(), found.end());
+
+  // The first month sharded, if any.
+  long int first = 0;
+  typedef vector<pair<long int, string> >::const_iterator iter;
+  for (iter i = found.begin(), e = found.end(); !first && i != e; ++i) {
+    first = i -> first;
+  }
+
+  vector<string> files;
+  for (iter i = found.begin(), e = found.end(); i != e; ++i) {
+    const long int month = i -> first;
+    const bool in_range = month
+      ? (since == 0 || month >= since) && (until == 0 || month <= until)
+      : since == 0 || first == 0 || since < first;
+    if (in_range) files.push_back(name(db_file, i -> second, i -> first));
+  }
+  return files;
+}
@@ -0,0 +1,70 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+
+#ifndef __ASH_SHARDS__
+#define __ASH_SHARDS__
+
+
+#include <time.h>  /* for time_t */
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace ash {
+
+
+/**
+ * Names the monthly shards of a history database.  When
+ * ASH_CFG_DB_SHARD_BY_MONTH is true, rows are written to a file for the
+ * current (UTC) month beside the history database: ~/.ash/history-2026-10.db
+ * rather than ~/.ash/history.db.  The history database itself keeps whatever
+ * was logged before sharding began.
+ *
+ * When ASH_CFG_DB_PER_HOST is true, each host writes files of its own, such
+ * as ~/.ash/history@host.db (or ~/.ash/history-2026-10@host.db), so hosts
+ * sharing a home directory over NFS never wait for each other's locks.
+ *
+ * The ids in each shard start at yyyymm * 10^9, plus a multiple of 2^48 that
+ * is different for each host, so ids are unique across shards and a session
+ * id is enough to find the shard holding the session.
+ */
+class Shards {
+  public:
+    static bool enabled();
+    static bool per_host();
+    static bool split();
+    static const string host();
+    static time_t begins(const long int month);
+    static long int month(const time_t when);
+    static long int parse_month(const string & yyyy_mm);
+
+    static const string current(const string & db_file);
+    static const string file(const string & db_file, const long int month);
+    static const string of_id(const string & db_file, const long int id);
+    static long int first_id(const string & file);
+    static const vector<string> find(const string & db_file,
+                                     const long int since,
+                                     const long int until);
+};
+
+
+} // namespace ash
+
+#endif  /* __ASH_SHARDS__ */
@@ -0,0 +1,613 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "snapshot.hpp"
+
+#include "database.hpp"
+#include "logger.hpp"
+
+#include <errno.h>     /* for errno */
+#include <fcntl.h>     /* for open */
+#include <limits.h>    /* for LONG_MIN */
+#include <pthread.h>   /* for pthread_create, pthread_join */
+#include <stdio.h>     /* for fread, fwrite, rename, tmpfile */
+#include <stdlib.h>    /* for mkstemp */
+#include <string.h>    /* for memchr, memcmp, strerror, strncmp */
+#include <sys/mman.h>  /* for mmap, munmap */
+#include <sys/stat.h>  /* for fstat */
+#include <unistd.h>    /* for close, sysconf, unlink */
+
+#include <algorithm>
+#include <sstream>
+
+// This hack silences a warning when compiling on a 64 bit platform with
+// -ansi and -pedantic flags enabled.
+// The original g++ complaint is that 'long long' is deprecated.
+#ifdef __LP64__
+#define SQLITE_INT64_TYPE long int
+#endif
+#include "sqlite3.h"
+
+// Every x86-64 CPU has SSE2; AVX2 is used if this one has it too.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ASH_SIMD
+#include <immintrin.h>
+#endif
+
+
+using namespace ash;
+using namespace std;
+
+
+/**
+ * The directory entry of a column in a snapshot file.  Sections start on a
+ * cache line.  An integer column is an array of a value for each row (NONE
+ * for NULL).  A text column is an array of an offset into its heap for each
+ * row, and one more for the end of the heap.
+ */
+struct Snapshot::Column {
+  char name[32];
+  long int text, rows, offset, heap, heap_size;
+};
+
+
+namespace {
+
+/**
+ * The first bytes of a snapshot file, followed by its directory.
+ */
+struct Header {
+  char magic[8];
+  long int columns;
+};
+
+const char MAGIC[8] = "ASHSNP1";
+const long int ALIGN = 64;
+const long int NONE = LONG_MIN;
+
+
+/**
+ * The columns copied into a snapshot.  Commands keep the id of their session,
+ * whose host and user are looked up only for the rows a grep shows.
+ */
+struct Field {
+  const char * table, * name;
+  bool text;
+};
+
+const Field FIELDS[] = {
+  {"commands", "id", false},
+  {"commands", "session_id", false},
+  {"commands", "start_time", false},
+  {"commands", "rval", false},
+  {"commands", "cwd", true},
+  {"commands", "command", true},
+  {"sessions", "id", false},
+  {"sessions", "hostname", true},
+  {"sessions", "logname", true},
+};
+const size_t FIELD_COUNT = sizeof(FIELDS) / sizeof(FIELDS[0]);
+
+
+/**
+ * A column being written, spilled to temporary files until its size is known.
+ */
+struct Spill {
+  Spill() : values(0), heap(0), rows(0), heap_size(0) {}
+  FILE * values, * heap;
+  long int rows, heap_size;
+};
+
+
+/**
+ * Returns the argument file offset rounded up to the start of a section.
+ */
+long int align(const long int at) {
+  return (at + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+
+/**
+ * Pads the output to the argument offset, then copies the argument temporary
+ * file to it.  Returns false on error.
+ */
+bool copy(FILE * from, FILE * to, const long int at) {
+  static const char zeros[ALIGN] = {0};
+  const long int pad = at - ftell(to);
+  if (pad < 0 || fwrite(zeros, 1, pad, to) != (size_t) pad) return false;
+  char buffer[1 << 16];
+  rewind(from);
+  for (size_t n; (n = fread(buffer, 1, sizeof(buffer), from)) > 0; ) {
+    if (fwrite(buffer, 1, n, to) != n) return false;
+  }
+  return !ferror(from);
+}
+
+
+/**
+ * A function that returns the first occurrence of a needle (of at least one
+ * character) in the range [p, end), or null if there is none.
+ */
+typedef const char * (*Finder)(const char * p, const char * end,
+                               const string & needle);
+
+
+/**
+ * Finds the needle with memchr on its first character, which libc already
+ * vectorizes.  This is the fallback on other CPUs and for the tail of a heap.
+ */
+const char * find_portable(const char * p, const char * end,
+                           const string & needle)
+{
+  const size_t n = needle.size();
+  while ((size_t) (end - p) >= n) {
+    p = (const char *) memchr(p, needle[0], end - p - n + 1);
+    if (!p) return 0;
+    if (!memcmp(p + 1, needle.data() + 1, n - 1)) return p;
+    ++p;
+  }
+  return 0;
+}
+
+
+#ifdef ASH_SIMD
+
+/**
+ * Finds the needle 16 positions at a time: a position is only compared in
+ * full if it starts with the first character of the needle and has the last
+ * character where the needle ends, which rules out almost all of them.
+ */
+const char * find_sse2(const char * p, const char * end,
+                       const string & needle)
+{
+  const size_t n = needle.size();
+  if (n < 2) return find_portable(p, end, needle);
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[n - 1]);
+  for (; (size_t) (end - p) >= n - 1 + 16; p += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i *) p);
+    const __m128i b = _mm_loadu_si128((const __m128i *) (p + n - 1));
+    unsigned int mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      const int i = __builtin_ctz(mask);
+      if (!memcmp(p + i + 1, needle.data() + 1, n - 2)) return p + i;
+    }
+  }
+  return find_portable(p, end, needle);
+}
+
+
+/**
+ * Finds the needle as find_sse2 does, 32 positions at a time.
+ */
+__attribute__((target("avx2")))
+const char * find_avx2(const char * p, const char * end,
+                       const string & needle)
+{
+  const size_t n = needle.size();
+  if (n < 2) return find_portable(p, end, needle);
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+  for (; (size_t) (end - p) >= n - 1 + 32; p += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *) p);
+    const __m256i b = _mm256_loadu_si256((const __m256i *) (p + n - 1));
+    unsigned int mask = _mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                       _mm256_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      const int i = __builtin_ctz(mask);
+      if (!memcmp(p + i + 1, needle.data() + 1, n - 2)) return p + i;
+    }
+  }
+  return find_portable(p, end, needle);
+}
+
+#endif  /* ASH_SIMD */
+
+
+/**
+ * Returns the fastest Finder this CPU can run.
+ */
+Finder best_finder() {
+#ifdef ASH_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return find_avx2;
+  return find_sse2;
+#else
+  return find_portable;
+#endif
+}
+
+
+/**
+ * The rows [first, last) of a snapshot scanned by one thread, and the rows of
+ * them that match.
+ */
+struct Scan {
+  long int first, last;
+  const char * commands, * cwds;
+  const long int * command_at, * cwd_at, * start_times;
+  const string * command, * cwd;
+  time_t since, until;
+  Finder find;
+  vector<long int> matches;
+};
+
+
+/**
+ * Returns true if the argument row was run in range, and in the directory
+ * tree being grepped for.
+ */
+bool in_scope(const Scan & scan, const long int row) {
+  const long int start = scan.start_times[row];
+  if (scan.since && (start == NONE || start < scan.since)) return false;
+  if (scan.until && (start == NONE || start >= scan.until)) return false;
+  if (scan.cwd -> empty()) return true;
+  const char * path = scan.cwds + scan.cwd_at[row];
+  const size_t n = scan.cwd -> size();
+  return !strncmp(path, scan.cwd -> c_str(), n)
+    && (path[n] == '\0' || path[n] == '/' || (*scan.cwd)[n - 1] == '/');
+}
+
+
+/**
+ * Collects the rows in scope whose command contains the needle, searching
+ * the heap of commands in one pass rather than row by row.
+ */
+void * scan_rows(void * arg) {
+  Scan & scan = *(Scan *) arg;
+  if (scan.command -> empty()) {
+    for (long int row = scan.first; row < scan.last; ++row) {
+      if (in_scope(scan, row)) scan.matches.push_back(row);
+    }
+    return 0;
+  }
+
+  const long int * at = scan.command_at;
+  const char * p = scan.commands + at[scan.first];
+  const char * end = scan.commands + at[scan.last];
+  while ((p = scan.find(p, end, *scan.command))) {
+    // The needle has no NUL, so a match never spans two commands.
+    const long int row = upper_bound(at + scan.first, at + scan.last,
+                                     (long int) (p - scan.commands)) - at - 1;
+    if (in_scope(scan, row)) scan.matches.push_back(row);
+    p = scan.commands + at[row + 1];
+  }
+  return 0;
+}
+
+
+/**
+ * Returns the argument time as the local date and time.
+ */
+const string local_time(const long int when) {
+  if (when == NONE) return "";
+  const time_t t = when;
+  struct tm tm;
+  char buffer[32];
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+  return buffer;
+}
+
+
+}  // namespace
+
+
+/**
+ * Returns the snapshot file of the argument history database.
+ */
+const string Snapshot::file(const string & db_file) {
+  const size_t n = db_file.size();
+  if (n > 3 && db_file.compare(n - 3, 3, ".db") == 0) {
+    return db_file.substr(0, n - 3) + "-snapshot.ash";
+  }
+  return db_file + "-snapshot.ash";
+}
+
+
+/**
+ * Copies the commands and sessions of the argument database into a new
+ * snapshot, replacing the argument file atomically.  Returns the number of
+ * commands copied, or -1 on error.
+ */
+long int Snapshot::write(Database & db, const string & file) {
+  vector<Spill> spills(FIELD_COUNT);
+  bool ok = true;
+  for (size_t f = 0; f < FIELD_COUNT; ++f) {
+    spills[f].values = tmpfile();
+    if (FIELDS[f].text) spills[f].heap = tmpfile();
+    ok = ok && spills[f].values && (!FIELDS[f].text || spills[f].heap);
+  }
+
+  // Spill each table to its columns, one row at a time.
+  const char * tables[] = {"commands", "sessions"};
+  for (size_t t = 0; ok && t < 2; ++t) {
+    vector<size_t> fields;
+    stringstream ss;
+    ss << "SELECT ";
+    for (size_t f = 0; f < FIELD_COUNT; ++f) {
+      if (string(FIELDS[f].table) != tables[t]) continue;
+      ss << (fields.empty() ? "" : ", ") << FIELDS[f].name;
+      fields.push_back(f);
+    }
+    ss << " FROM " << tables[t] << " ORDER BY id;";
+
+    sqlite3_stmt * ps = db.prepare_stmt(ss.str());
+    while (sqlite3_step(ps) == SQLITE_ROW) {
+      for (size_t c = 0; c < fields.size(); ++c) {
+        Spill & spill = spills[fields[c]];
+        const bool null = sqlite3_column_type(ps, c) == SQLITE_NULL;
+        long int value = null ? NONE : sqlite3_column_int64(ps, c);
+        if (FIELDS[fields[c]].text) {
+          const char * text = (const char *) sqlite3_column_text(ps, c);
+          const size_t bytes = text ? sqlite3_column_bytes(ps, c) : 0;
+          value = spill.heap_size;
+          fwrite(text ? text : "", 1, bytes, spill.heap);
+          fputc('\0', spill.heap);
+          spill.heap_size += bytes + 1;
+        }
+        fwrite(&value, sizeof(value), 1, spill.values);
+        ++spill.rows;
+      }
+    }
+    sqlite3_finalize(ps);
+
+    for (size_t c = 0; c < fields.size(); ++c) {
+      Spill & spill = spills[fields[c]];
+      if (FIELDS[fields[c]].text) {
+        fwrite(&spill.heap_size, sizeof(spill.heap_size), 1, spill.values);
+      }
+    }
+  }
+
+  // Lay out the sections, now that their sizes are known.
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.columns = FIELD_COUNT;
+  vector<Column> columns(FIELD_COUNT);
+  long int at = sizeof(header) + FIELD_COUNT * sizeof(Column);
+  for (size_t f = 0; f < FIELD_COUNT; ++f) {
+    Column & column = columns[f];
+    memset(&column, 0, sizeof(column));
+    snprintf(column.name, sizeof(column.name), "%s.%s", FIELDS[f].table,
+             FIELDS[f].name);
+    column.text = FIELDS[f].text;
+    column.rows = spills[f].rows;
+    column.offset = align(at);
+    at = column.offset + (column.rows + column.text) * sizeof(long int);
+    if (column.text) {
+      column.heap = align(at);
+      column.heap_size = spills[f].heap_size;
+      at = column.heap + column.heap_size;
+    }
+    ok = ok && !ferror(spills[f].values)
+      && (!spills[f].heap || !ferror(spills[f].heap));
+  }
+
+  string temp = file + ".XXXXXX";
+  const int fd = ok ? mkstemp(&temp[0]) : -1;
+  FILE * out = fd < 0 ? 0 : fdopen(fd, "wb");
+  ok = out
+    && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(&columns[0], sizeof(Column), FIELD_COUNT, out) == FIELD_COUNT;
+  for (size_t f = 0; ok && f < FIELD_COUNT; ++f) {
+    ok = copy(spills[f].values, out, columns[f].offset)
+      && (!columns[f].text || copy(spills[f].heap, out, columns[f].heap));
+  }
+  if (out && fclose(out)) ok = false;
+  if (!out && fd >= 0) close(fd);
+  for (size_t f = 0; f < FIELD_COUNT; ++f) {
+    if (spills[f].values) fclose(spills[f].values);
+    if (spills[f].heap) fclose(spills[f].heap);
+  }
+
+  if (!ok || rename(temp.c_str(), file.c_str())) {
+    LOG(ERROR) << "Failed to write the snapshot " << file << ": "
+               << strerror(errno);
+    if (fd >= 0) unlink(temp.c_str());
+    return -1;
+  }
+  return columns[0].rows;
+}
+
+
+/**
+ * Maps the argument snapshot file.  If it is missing or not a snapshot, a
+ * warning is logged and is_open is false.
+ */
+Snapshot::Snapshot(const string & file) : map(0), size(0) {
+  const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t) sizeof(Header)) {
+    LOG(WARNING) << "No snapshot found at " << file;
+    if (fd >= 0) close(fd);
+    return;
+  }
+  size = st.st_size;
+  void * mapped = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG(WARNING) << "Failed to map " << file << ": " << strerror(errno);
+    return;
+  }
+  map = mapped;
+
+  // Check that every column this build reads is there, and fits in the file.
+  const Header * header = (const Header *) map;
+  bool valid = !memcmp(header -> magic, MAGIC, sizeof(MAGIC))
+    && header -> columns >= 0
+    && sizeof(Header) + header -> columns * sizeof(Column) <= size;
+  for (size_t f = 0; valid && f < FIELD_COUNT; ++f) {
+    const Column * c = column(string(FIELDS[f].table) + "." + FIELDS[f].name);
+    const char * base = (const char *) map;
+    valid = c && c -> rows >= 0 && c -> text == FIELDS[f].text
+      && c -> offset >= 0 && c -> heap >= 0 && c -> heap_size >= 0
+      && (size_t) c -> offset + (c -> rows + c -> text) * sizeof(long int)
+        <= size
+      && (size_t) c -> heap + c -> heap_size <= size
+      && (!c -> text || (((const long int *) (base + c -> offset))[c -> rows]
+        == c -> heap_size && (!c -> heap_size
+          || base[c -> heap + c -> heap_size - 1] == '\0')));
+  }
+  if (!valid) {
+    LOG(WARNING) << "Not a snapshot from this version: " << file;
+    munmap((void *) map, size);
+    map = 0;
+  }
+}
+
+
+/**
+ * Unmaps the snapshot.
+ */
+Snapshot::~Snapshot() {
+  if (map) munmap((void *) map, size);
+}
+
+
+/**
+ * Returns true if the snapshot was mapped and is readable.
+ */
+bool Snapshot::is_open() const {
+  return map != 0;
+}
+
+
+/**
+ * Returns the directory entry of the argument column (table.column), or null
+ * if there is none.
+ */
+const Snapshot::Column * Snapshot::column(const string & name) const {
+  const Header * header = (const Header *) map;
+  const Column * columns = (const Column *) (header + 1);
+  for (long int i = 0; i < header -> columns; ++i) {
+    if (!strncmp(columns[i].name, name.c_str(), sizeof(columns[i].name))) {
+      return columns + i;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Returns the values of an integer column, or the heap offsets of a text
+ * column.
+ */
+const long int * Snapshot::longs(const string & name) const {
+  return (const long int *) ((const char *) map + column(name) -> offset);
+}
+
+
+/**
+ * Returns the heap of a text column.
+ */
+const char * Snapshot::heap(const string & name) const {
+  return (const char *) map + column(name) -> heap;
+}
+
+
+/**
+ * Returns the commands that contain the argument text, run in the argument
+ * directory tree, between since and until (either of which may be 0), oldest
+ * first.  An empty command or directory matches all of them.  Up to limit
+ * rows are returned, if it is positive.
+ */
+ResultSet * Snapshot::grep(const string & command, const string & cwd,
+                           const time_t since, const time_t until,
+                           const int limit) const
+{
+  const long int rows = column("commands.id") -> rows;
+  string tree = cwd;
+  while (tree.size() > 1 && tree[tree.size() - 1] == '/') {
+    tree.erase(tree.size() - 1);
+  }
+
+  // Split the rows among a thread for each core, if there are enough of them.
+  long int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  threads = max(1L, min(min(threads, 64L), rows / 65536 + 1));
+  vector<Scan> scans(threads);
+  vector<pthread_t> ids(threads);
+  vector<bool> started(threads, false);
+  const Finder find = best_finder();
+  for (long int t = 0; t < threads; ++t) {
+    Scan & scan = scans[t];
+    scan.first = rows * t / threads;
+    scan.last = rows * (t + 1) / threads;
+    scan.commands = heap("commands.command");
+    scan.command_at = longs("commands.command");
+    scan.cwds = heap("commands.cwd");
+    scan.cwd_at = longs("commands.cwd");
+    scan.start_times = longs("commands.start_time");
+    scan.command = &command;
+    scan.cwd = &tree;
+    scan.since = since;
+    scan.until = until;
+    scan.find = find;
+    if (t) started[t] = !pthread_create(&ids[t], 0, scan_rows, &scan);
+  }
+  scan_rows(&scans[0]);
+  for (long int t = 1; t < threads; ++t) {
+    if (started[t]) {
+      pthread_join(ids[t], 0);
+    } else {
+      scan_rows(&scans[t]);
+    }
+  }
+
+  // Only the rows shown are looked up.
+  const long int * session_ids = longs("sessions.id");
+  const long int sessions = column("sessions.id") -> rows;
+  ResultSet::HeadersType headers;
+  headers.push_back("when");
+  headers.push_back("host");
+  headers.push_back("user");
+  headers.push_back("where");
+  headers.push_back("rval");
+  headers.push_back("command");
+  ResultSet::DataType data;
+  ResultSet::ArenaType arena;
+  long int shown = 0;
+  for (long int t = 0; t < threads; ++t) {
+    const vector<long int> & matches = scans[t].matches;
+    for (size_t i = 0; i < matches.size(); ++i) {
+      if (limit > 0 && shown == limit) break;
+      const long int row = matches[i];
+      const long int session = longs("commands.session_id")[row];
+      const long int s = lower_bound(session_ids, session_ids + sessions,
+                                     session) - session_ids;
+      const bool found = s < sessions && session_ids[s] == session;
+      const long int rval = longs("commands.rval")[row];
+
+      const string when = local_time(longs("commands.start_time")[row]);
+      const char * values[] = {
+        when.c_str(),
+        found ? heap("sessions.hostname") + longs("sessions.hostname")[s] : "",
+        found ? heap("sessions.logname") + longs("sessions.logname")[s] : "",
+        scans[t].cwds + scans[t].cwd_at[row],
+      };
+      for (size_t v = 0; v < sizeof(values) / sizeof(*values); ++v) {
+        ResultSet::append(data, arena, Cell(values[v], strlen(values[v])));
+      }
+      ResultSet::append(data, arena, rval == NONE ? Cell() : Cell(rval));
+      const char * command = scans[t].commands + scans[t].command_at[row];
+      ResultSet::append(data, arena, Cell(command, strlen(command)));
+      ++shown;
+    }
+  }
+  return new ResultSet(headers, data, arena);
+}
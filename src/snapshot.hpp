@@ -0,0 +1,85 @@
+/*
+   Copyright 2011 Carl Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef __ASH_SNAPSHOT__
+#define __ASH_SNAPSHOT__
+
+
+#include <time.h>  /* for time_t */
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace ash {
+
+class Database;  // Forward declaration.
+class ResultSet;  // Forward declaration.
+
+
+/**
+ * A read-only, column by column copy of the commands in a history, joined
+ * with their sessions, for scans that sqlite can't index: a substring of any
+ * command, across tens of millions of them.
+ *
+ * The file is mapped rather than read.  Integer columns (ids, times, exit
+ * codes) are arrays of longs; text columns (host, user, directory, command)
+ * are one heap of NUL-terminated strings with an array of offsets into it.
+ * A grep scans a text heap as one long string, with SSE2 or AVX2 where the
+ * CPU has them, and splits the rows among a thread for each core.
+ *
+ * A snapshot is only ever read by the same build on the same machine, so no
+ * care is taken over byte order.
+ */
+class Snapshot {
+  // STATIC:
+  public:
+    static const string file(const string & db_file);
+    static long int write(Database & db, const string & file);
+
+  // NON-STATIC:
+  public:
+    Snapshot(const string & file);
+    ~Snapshot();
+
+    bool is_open() const;
+    ResultSet * grep(const string & command, const string & cwd,
+                     const time_t since, const time_t until,
+                     const int limit) const;
+
+  private:
+    struct Column;  // Forward declaration.
+
+    const Column * column(const string & name) const;
+    const long int * longs(const string & name) const;
+    const char * heap(const string & name) const;
+
+  private:
+    const void * map;
+    size_t size;
+
+  // DISALLOWED:
+  private:
+    Snapshot(const Snapshot & other);
+    Snapshot & operator = (const Snapshot & other);
+};
+
+
+}  // namespace ash
+
+#endif  /* __ASH_SNAPSHOT__ */
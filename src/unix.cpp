@@ -17,19 +17,14 @@
 #include "unix.hpp"
 
 #include "config.hpp"
-#include "database.hpp"
 #include "logger.hpp"
-#include "util.hpp"
+#include "process.hpp"
 
-#include <fstream>      /* for ifstream */
 #include <sstream>      /* for stringstream */
 
 #include <arpa/inet.h>  /* for inet_ntop */
-#include <errno.h>      /* for errno */
 #include <ifaddrs.h>    /* for getifaddrs, freeifaddrs */
 #include <stdlib.h>     /* for getenv */
-#include <string.h>     /* for strlen */
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>       /* for time */
 #include <unistd.h>     /* for getppid, get_current_dir_name */
@@ -39,70 +34,15 @@ using namespace ash;
 using namespace std;
 
 
-/**
- * Returns the i'th value (target) of /proc/${pid}/stat.
- */
-const string proc_stat(const int target, const pid_t pid) {
-  stringstream ss;
-  ss << "/proc/" << pid << "/stat";
-  ifstream fin(ss.str().c_str());
-  string token;
-  for (int i = 0; fin.good(); ++i) {
-    fin >> token;
-    if (i == target) break;
-  }
-  fin.close();
-  return token;
-}
-
-
 /**
  * Returns the current working directory.
  */
 const string unix::cwd() {
   char * c = get_current_dir_name();
-  if (!c) return DBObject::quote(0);
+  if (!c) return "";
   string cwd(c);
   free(c);
-  return DBObject::quote(cwd);
-}
-
-
-/**
- * Returns true if the argument file exists.
- */
-bool exists(const char * dir) {
-  struct stat st;
-  if (stat(dir, &st) != 0) {
-    LOG(DEBUG) << "tested file does not exist: '" << dir << "': "
-               << strerror(errno);
-    return false;
-  }
-  return true;
-}
-
-
-/**
- * Returns the output of the ps command (minus trailing newlines).
- */
-const char * ps(const string & args, pid_t pid) {
-  LOG(DEBUG) << "looking at ps output for ps " << args << " " << pid;
-  stringstream ss;
-  ss << "/bin/ps " << args << " " << pid;
-  FILE * p = popen(ss.str().c_str(), "r");
-  if (p) {
-    char buffer[256];
-    char * rval = fgets(buffer, 256, p);
-    pclose(p);
-    if (!rval) return "null";
-    for (size_t i = strlen(rval) - 1; i > 0; --i)
-      if (rval[i] == '\n') {
-        rval[i] = '\0';
-        break;
-      }
-    return rval;
-  }
-  return "null";
+  return cwd;
 }
 
 
@@ -110,25 +50,25 @@ const char * ps(const string & args, pid_t pid) {
  * Returns the parent process id of the argument process id.
  */
 const pid_t get_ppid(const pid_t pid) {
-  return atoi(exists("/proc") ? proc_stat(3, pid).c_str() : ps("ho ppid", pid));
+  return Process::get(pid).ppid;
 }
 
 
 /**
- * Returns the pid of the command-line shell.
+ * Returns the pid of the command-line shell.  This is looked up once, since
+ * several of the functions below need it.
  */
 const pid_t shell_pid() {
-  return get_ppid(getppid());
+  static pid_t pid = get_ppid(getppid());
+  return pid;
 }
 
 
 /**
  * Returns the parent process ID of the shell process.
  */
-const string unix::ppid() {
-  stringstream ss;
-  ss << get_ppid(shell_pid());
-  return ss.str();
+long int unix::ppid() {
+  return get_ppid(shell_pid());
 }
 
 
@@ -136,44 +76,31 @@ const string unix::ppid() {
  * Returns the name of the running shell.
  */
 const string unix::shell() {
-  if (exists("/proc")) {
-    LOG(DEBUG) << "looking for shell name in /proc/" << shell_pid() << "/stat.";
-    string sh = proc_stat(1, shell_pid());
-    // If the shell name is wrapped in parentheses, strip them.
-    if (!sh.empty() && sh[0] == '(' && sh[sh.length() - 1] == ')') {
-      sh = sh.substr(1, sh.length() - 2);
-    }
-    return DBObject::quote(sh);
-  } else {
-    // This is expected on OSX - no procfs so no /proc directory.
-    string sh = ps("ho command", shell_pid());
-    return sh == "null" ? sh : DBObject::quote(sh);
-  }
-  return "null";
+  return Process::get(shell_pid()).name;
 }
 
 
 /**
  * Returns the effective user ID.
  */
-const string unix::euid() {
-  return Util::to_string(geteuid());
+long int unix::euid() {
+  return geteuid();
 }
 
 
 /**
  * Returns the process ID of the shell.
  */
-const string unix::pid() {
-  return Util::to_string(shell_pid());
+long int unix::pid() {
+  return shell_pid();
 }
 
 
 /**
  * Returns the current local UNIX epoch timestamp.
  */
-const string unix::time() {
-  return Util::to_string(::time(0));
+long int unix::time() {
+  return ::time(0);
 }
 
 
@@ -181,20 +108,18 @@ const string unix::time() {
  * Returns the local time zone code.
  */
 const string unix::time_zone() {
-  stringstream ss;
   char zone_buffer[5];
   time_t now = ::time(0);
-  strftime(zone_buffer, 5, "%Z", localtime(&now));
-  ss << zone_buffer;
-  return DBObject::quote(ss.str());
+  if (strftime(zone_buffer, 5, "%Z", localtime(&now)) == 0) return "";
+  return zone_buffer;
 }
 
 
 /**
  * Returns the user ID running the command.
  */
-const string unix::uid() {
-  return Util::to_string(getuid());
+long int unix::uid() {
+  return getuid();
 }
 
 
@@ -205,7 +130,7 @@ const string unix::host_ip() {
   struct ifaddrs * addrs;
   if (getifaddrs(&addrs)) {
     LOG(INFO) << "No network addresses detected.";
-    return "null";
+    return "";
   }
 
   Config & config = Config::instance();
@@ -233,6 +158,7 @@ const string unix::host_ip() {
           inet_ntop(family, &(a -> sin_addr), buffer, sizeof(buffer));
         } else {
           LOG(DEBUG) << "Skipped an IPv4 address for: " << i -> ifa_name;
+          continue;
         }
         break;
       }
@@ -242,6 +168,7 @@ const string unix::host_ip() {
           inet_ntop(family, &(a -> sin6_addr), buffer, sizeof(buffer));
         } else {
           LOG(DEBUG) << "Skipped an IPv6 address for: " << i -> ifa_name;
+          continue;
         }
         break;
       }
@@ -252,8 +179,7 @@ const string unix::host_ip() {
     ss << buffer;
   }
   freeifaddrs(addrs);
-  if (ips == 0) return "null";
-  return DBObject::quote(ss.str());
+  return ss.str();
 }
 
 
@@ -264,8 +190,9 @@ const string unix::host_name() {
   char buffer[1024];
   if (gethostname(buffer, sizeof(buffer))) {
     perror("advanced shell history: Unix: gethostname");
+    return "";
   }
-  return DBObject::quote(buffer);
+  return buffer;
 }
 
 
@@ -273,19 +200,21 @@ const string unix::host_name() {
  * Return the login name of the user entering commands.
  */
 const string unix::login_name() {
-  return DBObject::quote(getlogin());
+  const char * name = getlogin();
+  return name ? name : "";
 }
 
 
 /**
  * Returns the abbreviated controlling TTY; the leading /dev/ is stripped.
+ * Stderr is tried after stdin, which is a pipe when serving a shell.
  */
 const string unix::tty() {
-  string tty = DBObject::quote(ttyname(0));
-  if (tty.find("/dev/") == 1) {
-    return "'" + tty.substr(6);
-  }
-  return tty;
+  const char * name = ttyname(0);
+  if (!name) name = ttyname(2);
+  if (!name) return "";
+  string tty(name);
+  return tty.find("/dev/") == 0 ? tty.substr(5) : tty;
 }
 
 
@@ -293,13 +222,15 @@ const string unix::tty() {
  * Returns the shell environment value for the argument variable.
  */
 const string unix::env(const char * name) {
-  return DBObject::quote(getenv(name));
+  const char * value = getenv(name);
+  return value ? value : "";
 }
 
 
 /**
  * Returns an integer-representation of a shell environment value.
  */
-const string unix::env_int(const char * name) {
-  return Util::to_string(atoi(getenv(name)));
+long int unix::env_int(const char * name) {
+  const char * value = getenv(name);
+  return value ? atol(value) : 0;
 }
@@ -27,24 +27,23 @@ namespace unix {
 /**
  * This namespace provides a variety of UNIX-related functions.
  *
- * All functions return a quoted-string value, an int string value or a string
- * representation of the keyword "null".  All are intended to be inserted
- * directly into SQL queries.
+ * String functions return the raw value, or an empty string if the value is
+ * unknown.  Numeric values are returned as integers.
  */
 const string cwd();
 const string env(const char * name);
-const string env_int(const char * name);
-const string euid();
+long int env_int(const char * name);
+long int euid();
 const string host_ip();
 const string host_name();
 const string login_name();
-const string pid();
-const string ppid();
+long int pid();
+long int ppid();
 const string shell();
-const string time();
+long int time();
 const string time_zone();
 const string tty();
-const string uid();
+long int uid();
 
 }  // namespace unix
 }  // namespace ash
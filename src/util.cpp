@@ -16,7 +16,8 @@
 
 #include "util.hpp"
 
-#include <sstream>
+#include <time.h>  /* for clock_gettime */
+
 #include <string>
 
 
@@ -25,11 +26,52 @@ using namespace std;
 
 
 /**
- * Converts an int to a string.
+ * Writes the decimal digits of an integer, two at a time, into the argument
+ * buffer (of at least 21 bytes) and returns how many were written.  The
+ * buffer is not NUL terminated.
+ */
+size_t Util::format(long int value, char * buffer) {
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+  char digits[20];
+  char * end = digits + sizeof(digits), * p = end;
+  // Negate as unsigned, so the least long int doesn't overflow.
+  unsigned long int n = value < 0 ? 0UL - value : value;
+  for (; n >= 100; n /= 100) {
+    p -= 2;
+    p[0] = pairs[(n % 100) * 2];
+    p[1] = pairs[(n % 100) * 2 + 1];
+  }
+  if (n >= 10) {
+    p -= 2;
+    p[0] = pairs[n * 2];
+    p[1] = pairs[n * 2 + 1];
+  } else {
+    *--p = '0' + n;
+  }
+  size_t size = 0;
+  if (value < 0) buffer[size++] = '-';
+  for (; p < end; ++p) buffer[size++] = *p;
+  return size;
+}
+
+
+/**
+ * Returns a monotonic timestamp in milliseconds.
+ */
+long int Util::now_ms() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts)) return 0;
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+
+/**
+ * Converts an integer to a string.
  */
-string Util::to_string(int value) {
-  static stringstream ss;
-  ss.str("");
-  ss << value;
-  return ss.str();
+string Util::to_string(long int value) {
+  char buffer[32];
+  return string(buffer, format(value, buffer));
 }
@@ -18,6 +18,8 @@
 #define __ASH_UTIL__
 
 
+#include <stddef.h>  /* for size_t */
+
 #include <string>
 
 using std::string;
@@ -30,7 +32,9 @@ namespace ash {
  */
 class Util {
   public:
-    static string to_string(int);
+    static size_t format(long int value, char * buffer);
+    static long int now_ms();
+    static string to_string(long int);
 };
 
 